@@ -2,6 +2,7 @@
 #include "AntfsSync.h"
 #include "AntMessage.h"
 #include "Storage.h"
+#include "FileCatalog.h"
 
 #include <assert.h>
 #include <iostream>
@@ -57,6 +58,20 @@ std::string MyPutTime(const struct std::tm *tm, const char *format)
     throw std::logic_error("strftime");
 }
 
+/** True if the file 'path' has the contents 'data', false if it differs or
+ * cannot be read. */
+bool SameContents(const std::string &path, const Buffer &data)
+{
+    try {
+        Buffer stored;
+        ReadData(path, stored);
+        return stored == data;
+    }
+    catch (std::exception &) {
+        return false;
+    }
+}
+
 };                                      // end anonymous namespace
 
 namespace FitSync {
@@ -109,6 +124,7 @@ inline std::ostream& operator<< (std::ostream &o, const AntfsDirent &f)
 AntfsChannel::AntfsChannel(AntStick *stick, int num, std::ostream *log_stream)
     : AntChannel (stick, num, BIDIRECTIONAL_RECEIVE, 4096, 0xff, 50),
       m_Retry(false),
+      m_FitParser(nullptr),
       m_State (CH_EMPTY),
       m_NumSends(0),
       m_NumCompletedSends(0),
@@ -420,6 +436,14 @@ void AntfsChannel::OnDownloadResponse (const unsigned char *data, int size)
     if (result == DRESP_OK)
     {
         std::copy(&data[16], &data[16] + chunk, std::back_inserter(m_FileData));
+        if (m_FileIndex > 0 && m_FitError.empty()) {
+            try {
+                m_FitParser.Feed(&data[16], chunk);
+            }
+            catch (std::exception &e) {
+                m_FitError = e.what();
+            }
+        }
         m_Offset += chunk;
         m_CrcSeed = crc_seed;
         download_complete = (m_Offset == total);
@@ -651,6 +675,8 @@ void AntfsChannel::ScheduleNextDownload()
         m_Offset = 0;
         m_CrcSeed = 0;
         m_RequestNextChunk = true;
+        m_FitParser.Reset();
+        m_FitError.clear();
     }
 }
 
@@ -711,10 +737,8 @@ void AntfsChannel::OnDirectoryDownloadComplete()
         if (f.Type() == FT_FIT && f.Readable())
         {
             // Check if we already have this file
-            std::ostringstream p;
-            p << GetFileStoragePath(m_DeviceSerial, f.SubType()) << '/' << f.GetFileName();
-            std::ifstream i(p.str().c_str());
-            if (! i) {                  // file does not exist
+            int dir = GetFileStorageDir(m_DeviceSerial, f.SubType());
+            if (! FileExistsAt(dir, f.GetFileName())) {
                 files.push_back (f);
             }
         }
@@ -766,8 +790,65 @@ void AntfsChannel::OnFileDownloadComplete()
     std::ostringstream p;
     p << GetFileStoragePath(m_DeviceSerial, f.SubType()) << '/' << f.GetFileName();
 
+    if (m_FitError.empty()) {
+        try {
+            m_FitParser.Finish();
+        }
+        catch (std::exception &e) {
+            m_FitError = e.what();
+        }
+    }
+    if (! m_FitError.empty()) {
+        // Save the file anyway, the user may still be able to recover it.
+        PutTimestamp(*m_LogStream);
+        (*m_LogStream) << "Bad FIT data in " << f.GetFileName() << ": " << m_FitError << "\n" << std::flush;
+    }
+
     try {
-        WriteData(p.str().c_str(), m_FileData);
+        FileCatalog &catalog = GetFileCatalog();
+        std::string base = GetBaseStoragePath();
+        int dir = GetFileStorageDir(m_DeviceSerial, f.SubType());
+
+        FileCatalog::Entry e;
+        e.Hash = FileCatalog::ContentHash(m_FileData.data(), m_FileData.size());
+        e.SerialNumber = m_DeviceSerial;
+        e.TimeCreated = 0;
+        e.Type = f.SubType();
+        e.Size = m_FileData.size();
+        e.Path = p.str().substr(base.size() + 1);
+        fit::FitFileId fid;
+        bool have_id = false;
+        try {
+            have_id = fit::ProbeFileId(m_FileData.data(), m_FileData.size(), fid);
+        }
+        catch (std::exception &) {
+            // Bad FIT data, already reported above
+        }
+        if (have_id) {
+            e.SerialNumber = fid.SerialNumber;
+            e.TimeCreated = fid.TimeCreated;
+            e.Type = fid.Type.value;
+        }
+
+        // The file may already be stored, received by fit-sync-usb: link
+        // to it instead of storing a second copy.  The link also shows the
+        // file as downloaded the next time the device directory is read.
+        // The hash is not collision free and a stored file may have been
+        // changed since, so the contents are compared before linking.
+        FileCatalog::Entry stored;
+        if (((have_id && catalog.Find(e.SerialNumber, e.Type, e.TimeCreated, stored)
+              && stored.Size == e.Size && SameContents(base + '/' + stored.Path, m_FileData))
+             || (catalog.FindByHash(e.Hash, stored) && stored.Size == e.Size
+                 && SameContents(base + '/' + stored.Path, m_FileData)))
+            && LinkFileAt(base + '/' + stored.Path, dir, f.GetFileName())) {
+            PutTimestamp(*m_LogStream);
+            (*m_LogStream) << "Linked " << p.str() << " to " << stored.Path
+                           << ", already stored.\n" << std::flush;
+            return;
+        }
+
+        WriteDataAt(dir, f.GetFileName(), m_FileData.data(), m_FileData.size());
+        catalog.Add(e);
         PutTimestamp(*m_LogStream);
         (*m_LogStream) << "Wrote " << p.str() << ", " << m_FileData.size() << " bytes.\n" << std::flush;
     }
@@ -785,6 +866,8 @@ void AntfsChannel::ForgetDevice()
     m_Offset = 0;
     m_CrcSeed = 0;
     m_RequestNextChunk = false;
+    m_FitParser.Reset();
+    m_FitError.clear();
     m_DownloadBacklog.clear();
     m_BurstPartialData.clear();
 
@@ -2,6 +2,7 @@
 
 #include "AntStick.h"
 #include "AntMessage.h"
+#include "FitFile.h"
 #include <string>
 #include <ctime>
 #include <iomanip>
@@ -113,6 +114,10 @@ private:
     unsigned m_CrcSeed;
     bool m_RequestNextChunk;
 
+    // Checks the FIT data of the file being downloaded as it arrives.
+    fit::StreamParser m_FitParser;
+    std::string m_FitError;
+
     std::vector<AntfsDirent> m_DownloadBacklog;
 
     Buffer m_BurstPartialData;
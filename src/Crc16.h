@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fit {
+
+/** Compute the CRC-16 used by FIT files over 'len' bytes at 'data'.  A FIT
+ * header or file including its trailing CRC bytes has a CRC of 0.
+ */
+uint16_t Crc16(const unsigned char *data, size_t len);
+
+/** Update a running CRC-16 value with 'len' more bytes from 'data'.  Start
+ * with a 'crc' of 0, and pass the returned value in the next call.  This
+ * allows computing the CRC as data arrives, feeding it in any size chunks
+ * produces the same result as a single Crc16() call.
+ */
+uint16_t Crc16Update(uint16_t crc, const unsigned char *data, size_t len);
+
+/** The individual CRC-16 implementations.  Crc16Update() uses the
+ * slicing-by-8 one, they are exposed for testing and benchmarking only (see
+ * bench/crc-test and bench/crc-bench).
+ */
+uint16_t Crc16UpdateByte(uint16_t crc, const unsigned char *data, size_t len);
+uint16_t Crc16UpdateSlice8(uint16_t crc, const unsigned char *data, size_t len);
+
+};                                      // end namespace fit
@@ -0,0 +1,199 @@
+#include "FileCatalog.h"
+
+#include <sstream>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+
+    const char *g_CatalogHeader = "FITSYNC-CATALOG 1";
+
+    /** Hold a flock() on a file for the life of the object. */
+    class FileLock
+    {
+    public:
+        FileLock(int fd, int operation) : m_Fd(fd) {
+            while (::flock(m_Fd, operation) == -1 && errno == EINTR)
+                ;
+        }
+        ~FileLock() {
+            ::flock(m_Fd, LOCK_UN);
+        }
+    private:
+        int m_Fd;
+    };
+
+    /** Write all of 'data' to 'fd', returns false on error. */
+    bool WriteAll(int fd, const std::string &data)
+    {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            ssize_t n = ::write(fd, data.data() + pos, data.size() - pos);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            pos += n;
+        }
+        return true;
+    }
+
+};                                      // end anonymous namespace
+
+namespace FitSync
+{
+
+    FileCatalog::FileCatalog(const std::string &file_name)
+        : m_Fd(-1), m_Valid(false), m_Offset(0)
+    {
+        m_Fd = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_Fd == -1)
+            return;
+        FileLock lock(m_Fd, LOCK_EX);
+        struct stat st;
+        if (::fstat(m_Fd, &st) == -1)
+            return;
+        if (st.st_size == 0 && ! WriteAll(m_Fd, std::string(g_CatalogHeader) + "\n"))
+            return;
+        m_Valid = true;
+        Refresh();
+    }
+
+    FileCatalog::~FileCatalog()
+    {
+        if (m_Fd != -1)
+            ::close(m_Fd);
+    }
+
+    bool FileCatalog::Find(uint32_t serial, int type, uint32_t time_created, Entry &e)
+    {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        if (! m_Valid)
+            return false;
+        {
+            FileLock lock(m_Fd, LOCK_SH);
+            Refresh();
+        }
+        Key k = { serial, time_created, type };
+        auto i = m_ByFileId.find(k);
+        if (i == m_ByFileId.end())
+            return false;
+        e = m_Entries[i->second];
+        return true;
+    }
+
+    bool FileCatalog::FindByHash(uint64_t hash, Entry &e)
+    {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        if (! m_Valid || hash == 0)
+            return false;
+        {
+            FileLock lock(m_Fd, LOCK_SH);
+            Refresh();
+        }
+        auto i = m_ByHash.find(hash);
+        if (i == m_ByHash.end())
+            return false;
+        e = m_Entries[i->second];
+        return true;
+    }
+
+    void FileCatalog::Add(const Entry &e)
+    {
+        // Entries are stored one per line
+        if (e.Path.empty() || e.Path.find('\n') != std::string::npos)
+            return;
+
+        std::ostringstream line;
+        line << std::hex << e.Hash << std::dec << ' ' << e.SerialNumber
+             << ' ' << e.TimeCreated << ' ' << e.Type << ' ' << e.Size
+             << ' ' << e.Path << "\n";
+
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        if (! m_Valid)
+            return;
+        FileLock lock(m_Fd, LOCK_EX);
+        Refresh();
+        // A process which died while appending can leave a partial line,
+        // start a new one, the partial line will be skipped.
+        struct stat st;
+        std::string data = line.str();
+        if (::fstat(m_Fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > m_Offset)
+            data = "\n" + data;
+        if (WriteAll(m_Fd, data))
+            Refresh();
+    }
+
+    uint64_t FileCatalog::ContentHash(const unsigned char *data, size_t size)
+    {
+        // 64 bit FNV-1a
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; i++) {
+            h ^= data[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h != 0 ? h : 1;
+    }
+
+    void FileCatalog::Refresh()
+    {
+        struct stat st;
+        if (::fstat(m_Fd, &st) == -1 || static_cast<uint64_t>(st.st_size) <= m_Offset)
+            return;
+
+        std::string data(st.st_size - m_Offset, '\0');
+        size_t pos = 0;
+        while (pos < data.size()) {
+            ssize_t n = ::pread(m_Fd, &data[pos], data.size() - pos, m_Offset + pos);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            pos += n;
+        }
+        data.resize(pos);
+
+        // Only complete lines are read, a line still being written is read
+        // next time.
+        size_t start = 0;
+        for (size_t end = data.find('\n'); end != std::string::npos;
+             start = end + 1, end = data.find('\n', start)) {
+            std::string line = data.substr(start, end - start);
+            if (m_Offset == 0 && start == 0) {
+                if (line != g_CatalogHeader) {
+                    m_Valid = false;
+                    return;
+                }
+                continue;
+            }
+            // Each line is: HASH SERIAL TIME TYPE SIZE PATH, the path runs to
+            // the end of the line.
+            std::istringstream fields(line);
+            Entry e;
+            fields >> std::hex >> e.Hash >> std::dec >> e.SerialNumber
+                   >> e.TimeCreated >> e.Type >> e.Size;
+            fields.get();               // the space before the path
+            std::getline(fields, e.Path);
+            if (! fields.eof() || e.Path.empty())
+                continue;               // a damaged line
+            AddToIndex(e);
+        }
+        m_Offset += start;
+    }
+
+    void FileCatalog::AddToIndex(const Entry &e)
+    {
+        size_t index = m_Entries.size();
+        m_Entries.push_back(e);
+        Key k = { e.SerialNumber, e.TimeCreated, e.Type };
+        m_ByFileId[k] = index;
+        if (e.Hash != 0)
+            m_ByHash[e.Hash] = index;
+    }
+
+};                                      // end namespace FitSync
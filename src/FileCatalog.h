@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace FitSync
+{
+    /** The FIT files in the storage directory, shared by fit-sync-usb and
+     * fit-sync-ant, so that a file received both over USB and over ANT-FS
+     * is stored only once.  Files are identified by the serial number,
+     * creation time and type from their FIT file ID message, and by a hash
+     * of their contents, when it is known.
+     *
+     * The catalog is an append only text file: each stored file adds a line
+     * and the most recent line for a file wins.  An in-memory index of the
+     * lines is kept, so lookups don't touch the file system, except for
+     * checking whether another process appended to the catalog.  Appends
+     * are done under an exclusive flock() and reads under a shared one, so
+     * several processes can use the catalog at the same time.  An instance
+     * can also be shared between threads.
+     */
+    class FileCatalog
+    {
+    public:
+        struct Entry {
+            uint64_t Hash;              // see ContentHash(), 0 if not known
+            uint32_t SerialNumber;
+            uint32_t TimeCreated;
+            int Type;                   // FIT file type
+            uint64_t Size;
+            std::string Path;           // relative to GetBaseStoragePath()
+        };
+
+        /** Open the catalog 'file_name', creating it if needed.  A catalog
+         * which cannot be opened, or has an unknown format, is empty and
+         * files added to it are not recorded. */
+        FileCatalog(const std::string &file_name);
+        ~FileCatalog();
+
+        /** Find the stored file with the FIT file ID 'serial', 'type' and
+         * 'time_created'.  Returns false if there is no such file. */
+        bool Find(uint32_t serial, int type, uint32_t time_created, Entry &e);
+
+        /** Find the stored file whose contents hash to 'hash'. */
+        bool FindByHash(uint64_t hash, Entry &e);
+
+        /** Record that the file 'e' was stored. */
+        void Add(const Entry &e);
+
+        /** Hash of the 'size' bytes at 'data', this is never 0. */
+        static uint64_t ContentHash(const unsigned char *data, size_t size);
+
+    private:
+        FileCatalog(const FileCatalog&) = delete;
+        FileCatalog& operator=(const FileCatalog&) = delete;
+
+        struct Key {
+            uint32_t SerialNumber;
+            uint32_t TimeCreated;
+            int Type;
+            bool operator==(const Key &other) const {
+                return SerialNumber == other.SerialNumber
+                    && TimeCreated == other.TimeCreated
+                    && Type == other.Type;
+            }
+        };
+
+        struct KeyHash {
+            size_t operator()(const Key &k) const {
+                return std::hash<uint64_t>()(
+                    (static_cast<uint64_t>(k.SerialNumber) << 32 | k.TimeCreated) ^ k.Type);
+            }
+        };
+
+        /** Read the lines appended to the file since it was last read.  The
+         * caller holds m_Mutex. */
+        void Refresh();
+        void AddToIndex(const Entry &e);
+
+        std::mutex m_Mutex;
+        int m_Fd;
+        bool m_Valid;
+        uint64_t m_Offset;              // end of the last line read
+        std::vector<Entry> m_Entries;
+        std::unordered_map<Key, size_t, KeyHash> m_ByFileId;
+        std::unordered_map<uint64_t, size_t> m_ByHash;
+    };
+
+};                                      // end namespace FitSync
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
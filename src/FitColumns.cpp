@@ -0,0 +1,71 @@
+#include "FitColumns.h"
+#include "FitProfile.h"
+
+namespace fit {
+
+void RecordColumns::Reserve(size_t n)
+{
+    Timestamp.Reserve(n);
+    PositionLat.Reserve(n);
+    PositionLong.Reserve(n);
+    Altitude.Reserve(n);
+    HeartRate.Reserve(n);
+    Cadence.Reserve(n);
+    Power.Reserve(n);
+    Speed.Reserve(n);
+    Distance.Reserve(n);
+    Temperature.Reserve(n);
+}
+
+void RecordColumns::Clear()
+{
+    Timestamp.Clear();
+    PositionLat.Clear();
+    PositionLong.Clear();
+    Altitude.Clear();
+    HeartRate.Clear();
+    Cadence.Clear();
+    Power.Clear();
+    Speed.Clear();
+    Distance.Clear();
+    Temperature.Clear();
+}
+
+void RecordColumns::Append(const FitRecord &r)
+{
+    using namespace profile::record;
+
+    Timestamp.Append(r.Timestamp, r.Timestamp.isNA());
+    PositionLat.Append(r.PositionLat, r.PositionLat.isNA());
+    PositionLong.Append(r.PositionLong, r.PositionLong.isNA());
+    Altitude.Append(profile::ToPhysical<MESSAGE, enhanced_altitude>(r.Altitude.value),
+                    r.Altitude.isNA());
+    HeartRate.Append(r.HeartRate, r.HeartRate.isNA());
+    Cadence.Append(r.Cadence, r.Cadence.isNA());
+    Power.Append(r.Power, r.Power.isNA());
+    Speed.Append(profile::ToPhysical<MESSAGE, enhanced_speed>(r.Speed.value),
+                 r.Speed.isNA());
+    Distance.Append(profile::ToPhysical<MESSAGE, distance>(r.Distance.value),
+                    r.Distance.isNA());
+    Temperature.Append(r.Temperature, r.Temperature.isNA());
+}
+
+RecordColumnsBuilder::RecordColumnsBuilder(RecordColumns &columns)
+    : m_Columns(columns)
+{
+    Subscribe(GMN_RECORD);
+}
+
+void RecordColumnsBuilder::OnFitRecord(const FitRecord &r)
+{
+    m_Columns.Append(r);
+}
+
+void ReadRecordColumns(const unsigned char *data, size_t length, RecordColumns &columns)
+{
+    columns.Reserve(columns.Size() + CountFitMessages(data, length, GMN_RECORD));
+    RecordColumnsBuilder b(columns);
+    ReadFitMessages(data, length, &b);
+}
+
+};                                      // end namespace fit
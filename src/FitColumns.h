@@ -0,0 +1,94 @@
+#pragma once
+#include "FitFile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace fit {
+
+/** A single column of values, stored contiguously, with a bitmap marking
+ * the values which are not available (NA).  Values which are NA are stored
+ * as 0, so loops over Values can ignore the bitmap if 0 is acceptable.
+ */
+template <typename T>
+class FitColumn
+{
+public:
+    void Reserve(size_t n)
+        {
+            Values.reserve(n);
+            NA.reserve((n + 63) / 64);
+        }
+
+    void Clear()
+        {
+            Values.clear();
+            NA.clear();
+        }
+
+    void Append(T value, bool na)
+        {
+            size_t i = Values.size();
+            if (i % 64 == 0)
+                NA.push_back(0);
+            if (na) {
+                NA.back() |= uint64_t(1) << (i % 64);
+                value = T();
+            }
+            Values.push_back(value);
+        }
+
+    size_t Size() const { return Values.size(); }
+    bool IsNA(size_t i) const { return (NA[i / 64] >> (i % 64)) & 1; }
+
+    std::vector<T> Values;
+    /** Bit 'i % 64' of NA[i / 64] is set if Values[i] is not available. */
+    std::vector<uint64_t> NA;
+};
+
+/** Record messages decoded into one column per field, in physical units.
+ * Analysis code can scan a single column with a simple loop, instead of
+ * walking a vector of records.
+ */
+class RecordColumns
+{
+public:
+    /** Reserve space for 'n' records in all columns. */
+    void Reserve(size_t n);
+    void Clear();
+    void Append(const FitRecord &r);
+    size_t Size() const { return Timestamp.Size(); }
+
+    FitColumn<uint32_t> Timestamp;      // UNIX time
+    FitColumn<int32_t> PositionLat;     // semicircles
+    FitColumn<int32_t> PositionLong;    // semicircles
+    FitColumn<float> Altitude;          // meters
+    FitColumn<uint8_t> HeartRate;       // bpm
+    FitColumn<uint8_t> Cadence;         // rpm
+    FitColumn<uint16_t> Power;          // watts
+    FitColumn<float> Speed;             // meters/second
+    FitColumn<double> Distance;         // meters
+    FitColumn<int8_t> Temperature;      // degrees Celsius
+};
+
+/** A FitBuilder which appends all record messages to a RecordColumns
+ * instance. */
+class RecordColumnsBuilder : public FitBuilder
+{
+public:
+    RecordColumnsBuilder(RecordColumns &columns);
+    void OnFitRecord(const FitRecord &r) override;
+
+private:
+    RecordColumns &m_Columns;
+};
+
+/** Read all record messages from 'length' bytes of FIT data at 'data' and
+ * append them to 'columns'.  The record messages are counted first (see
+ * CountFitMessages()), so the columns are allocated once, at their final
+ * size.
+ */
+void ReadRecordColumns(const unsigned char *data, size_t length, RecordColumns &columns);
+
+};                                      // end namespace fit
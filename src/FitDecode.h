@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+
+namespace fit {
+
+// Decoding of FIT values from their bytes, in either byte order.  These are
+// used by FitFile.cpp, they are in a header of their own so that
+// bench/decode-bench can measure them.
+
+/** Unsigned integer type with the same size as a base type, bytes are
+ * swapped in these. */
+template <size_t N> struct UnsignedOfSize;
+template <> struct UnsignedOfSize<1> { typedef uint8_t type; };
+template <> struct UnsignedOfSize<2> { typedef uint16_t type; };
+template <> struct UnsignedOfSize<4> { typedef uint32_t type; };
+template <> struct UnsignedOfSize<8> { typedef uint64_t type; };
+
+inline uint8_t SwapBytes(uint8_t v) { return v; }
+inline uint16_t SwapBytes(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t SwapBytes(uint32_t v) { return __builtin_bswap32(v); }
+inline uint64_t SwapBytes(uint64_t v) { return __builtin_bswap64(v); }
+
+/** Decode a value of type 'BT' stored at 'data', reversing the bytes if
+ * needed.  'data' need not be aligned, this compiles to a plain load,
+ * followed by a byte swap instruction when 'revert' is set. */
+template <typename BT> BT DecodeAs (const unsigned char *data, bool revert)
+{
+    typename UnsignedOfSize<sizeof(BT)>::type u;
+    std::memcpy(&u, data, sizeof(u));
+    if (revert)
+        u = SwapBytes(u);
+    BT b;
+    std::memcpy(&b, &u, sizeof(b));
+    return b;
+}
+
+/** Swap the bytes of 'count' values of type 'U' at 'p'. */
+template <typename U> void SwapArrayBytes (unsigned char *p, int count)
+{
+    for (int i = 0; i < count; ++i, p += sizeof(U)) {
+        U u;
+        std::memcpy(&u, p, sizeof(u));
+        u = SwapBytes(u);
+        std::memcpy(p, &u, sizeof(u));
+    }
+}
+
+/** Decode 'count' values of type 'BT' stored at 'data' into 'out'.  The
+ * values are copied in one go and their bytes then swapped, in blocks of 16
+ * bytes: a loop with a fixed count is vectorized by the compiler even at
+ * -O2. */
+template <typename BT> void DecodeArrayAs (const unsigned char *data, int count, bool revert, BT *out)
+{
+    typedef typename UnsignedOfSize<sizeof(BT)>::type U;
+    std::memcpy(out, data, count * sizeof(BT));
+    if (revert && sizeof(BT) > 1) {
+        const int block = 16 / sizeof(BT);
+        unsigned char *p = reinterpret_cast<unsigned char*>(out);
+        int i = 0;
+        for (; i + block <= count; i += block, p += 16)
+            SwapArrayBytes<U>(p, block);
+        SwapArrayBytes<U>(p, count - i);
+    }
+}
+
+};                                      // end namespace fit
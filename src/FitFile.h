@@ -2,6 +2,8 @@
 #pragma once
 #include <stdint.h>
 #include <iosfwd>
+#include <memory>
+#include <string>
 #include <stdexcept>
 #include <vector>
 
@@ -86,6 +88,27 @@ typedef FitType<0x8B, uint16_t, 0x0> FitUint16z;
 typedef FitType<0x8C, uint32_t, 0x0> FitUint32z;
 typedef FitType<0x0D, uint8_t, 0xFF> FitByte;
 
+/** Global message numbers, as defined by the FIT profile. */
+enum GlobalMessageNumber
+{
+    GMN_FILE_ID = 0,
+    GMN_SESSION = 18,
+    GMN_LAP = 19,
+    GMN_RECORD = 20,
+    GMN_EVENT = 21,
+    GMN_DEVICE_INFO = 23,
+    GMN_ACTIVITY = 34,
+    GMN_FILE_CREATOR = 49,
+    GMN_MONITORING = 55,
+    GMN_TRAINING_FILE = 72,
+    GMN_HRV = 78,
+    GMN_LENGTH = 101,
+    GMN_MONITORING_INFO = 103,
+    GMN_TIMESTAMP_CORRELATION = 162,
+    GMN_FIELD_DESCRIPTION = 206,
+    GMN_DEVELOPER_DATA_ID = 207
+};
+
 struct FitFileId
 {
     FitEnum Type;
@@ -105,6 +128,8 @@ struct FitFileCreator
 
 std::ostream& operator<<(std::ostream &o, const FitFileCreator &m);
 
+/** A timestamp_correlation message.  All times are in UNIX time, the local
+ * time is in the device time zone. */
 struct FitTimestampCorrelation
 {
     FitUint32 Timestamp;
@@ -136,8 +161,24 @@ struct FitLap {
 struct FitLength {
 };
 
+/** A record message, holding the most commonly used fields.  Values are in
+ * FIT units: the position is in semicircles, Altitude has a scale of 5 and an
+ * offset of 500 (meters), Distance has a scale of 100 (meters) and Speed a
+ * scale of 1000 (meters/second).  Timestamp is in UNIX time, LocalTimestamp
+ * is the same time in the device time zone, if the file says what that is.
+ */
 struct FitRecord {
-
+    FitUint32 Timestamp;
+    FitSint32 PositionLat;
+    FitSint32 PositionLong;
+    FitUint32 Altitude;                 // enhanced_altitude, if present
+    FitUint8 HeartRate;
+    FitUint8 Cadence;
+    FitUint32 Distance;
+    FitUint32 Speed;                    // enhanced_speed, if present
+    FitUint16 Power;
+    FitSint8 Temperature;
+    FitUint32 LocalTimestamp;
 };
 
 struct FitEvent {
@@ -156,29 +197,362 @@ struct FitHrv {
 
 };
 
+/** A developer_data_id message, identifying the application (for example a
+ * Connect IQ data field) which writes developer fields with
+ * DeveloperDataIndex. */
+struct FitDeveloperDataId
+{
+    FitByte ApplicationId[16];
+    FitUint16 ManufacturerId;
+    FitUint8 DeveloperDataIndex;
+    FitUint32 ApplicationVersion;
+};
+
+/** A field_description message, describing a developer field.  Developer
+ * fields are identified by the DeveloperDataIndex and FieldNumber pair.  A
+ * value in the field's Units is RAW / Scale - Offset.  NativeMessage and
+ * NativeField are set if the field replaces a field from the FIT profile.
+ */
+struct FitDeveloperField
+{
+    FitUint8 DeveloperDataIndex;
+    FitUint8 FieldNumber;
+    FitUint8 BaseType;
+    std::string Name;
+    std::string Units;
+    FitUint8 Scale;
+    FitSint8 Offset;
+    FitUint16 NativeMessage;
+    FitUint8 NativeField;
+};
+
+std::ostream& operator<<(std::ostream &o, const FitDeveloperField &m);
+
+/** The value of a developer field in a data message.  This is a view into
+ * the FIT data, so it is only valid during the
+ * FitBuilder::OnFitDeveloperValue() call, values are decoded on demand.
+ */
+class FitDeveloperValue
+{
+public:
+    FitDeveloperValue(const FitDeveloperField *field, const FitDeveloperDataId *id,
+                      int count, const unsigned char *data, bool revert)
+        : m_Field(field), m_DataId(id), m_Count(count), m_Data(data), m_RevertBytes(revert)
+        {
+            // empty
+        }
+
+    /** The description of this field. */
+    const FitDeveloperField& Field() const { return *m_Field; }
+
+    /** The application which wrote this field, nullptr if the file has no
+     * developer_data_id message for it. */
+    const FitDeveloperDataId* DataId() const { return m_DataId; }
+
+    /** Number of values, more than one if the field is an array. */
+    int Count() const { return m_Count; }
+
+    /** Return true if value 'index' is not available. */
+    bool IsNA(int index = 0) const;
+
+    /** Return value 'index' in the field's units, with the scale and offset
+     * applied, or NaN if the value is not available. */
+    double Value(int index = 0) const;
+
+    /** Store all the values in 'out', which must have room for Count()
+     * values, and return Count().  The values are the same as the ones
+     * returned by Value(), but the whole array is decoded at once, which is
+     * faster for array fields. */
+    int Values(double *out) const;
+
+    /** Return the value of a string field, or an empty string if this is not
+     * a string field. */
+    std::string String() const;
+
+private:
+    const FitDeveloperField *m_Field;
+    const FitDeveloperDataId *m_DataId;
+    int m_Count;
+    const unsigned char *m_Data;
+    bool m_RevertBytes;
+};
+
 /** Builder class for FIT files.  A derived class needs to be implemented by
  * the client and passed to 'ReadFitMessages'.  The instance of the class will
  * receive "On..." notifications as messages are read from the data file.
  * Note that the methods are not virtual, so the client only needs to
  * implement handlers for messages they are interested in.
  *
+ * A builder can stop the parsing early by calling RequestStop() from one of
+ * its callbacks, the reader will not decode any more messages after that.
+ * For example, code that only looks for file ID messages can request a stop
+ * in OnFitFileId(), which saves time since this message is usually at the
+ * start of the file.
+ *
+ * Developer fields are only decoded for builders which ask for them using
+ * SetNeedsDeveloperFields().  Their values are passed to
+ * OnFitDeveloperValue(), after the call for the message they belong to.
+ *
  * @note ReadFitMessages is exception safe.  this means that an implementation
- * of this class can abort parsing by throwing an exception (not derived from
- * std::exception).  For example, code that only looks for file ID messages
- * can throw an exception in the OnFitFileId() method (which would need to be
- * caught).  This will cause the parsing to be aborted, which would save time
- * since this message is usually at the start of the file.
+ * of this class can also abort parsing by throwing an exception (not derived
+ * from std::exception), which would need to be caught.  RequestStop() is
+ * preferred, as unwinding is expensive.
  */
 class FitBuilder
 {
 public:
+    FitBuilder();
     virtual ~FitBuilder();
     virtual void OnFitFileId(const FitFileId &message);
     virtual void OnFitFileCreator (const FitFileCreator &message);
+    virtual void OnFitRecord (const FitRecord &message);
+    virtual void OnFitTimestampCorrelation (const FitTimestampCorrelation &message);
+    virtual void OnFitDeveloperDataId (const FitDeveloperDataId &message);
+    virtual void OnFitFieldDescription (const FitDeveloperField &message);
+
+    /** Receive the value of a developer field, 'global_message' is the
+     * message the field is part of. */
+    virtual void OnFitDeveloperValue (int global_message, const FitDeveloperValue &value);
+
+    /** Return true if this builder wants to receive messages with the
+     * 'global_message' number.  Messages which are not wanted are skipped
+     * without decoding any of their fields. */
+    bool IsSubscribed(int global_message) const;
+
+    /** Return true if messages need to have their timestamp tracked. */
+    bool NeedsTimestamps() const { return m_NeedsTimestamps; }
+
+    /** Return true if developer fields need to be decoded. */
+    bool NeedsDeveloperFields() const { return m_NeedsDeveloperFields; }
+
+    /** Return true if the builder asked for parsing to stop. */
+    bool StopRequested() const { return m_StopRequested; }
+
+    /** Clear a previous stop request.  ReadFitMessages() and
+     * StreamParser::Reset() do this, so a builder can be re-used. */
+    void ClearStopRequest() { m_StopRequested = false; }
+
+protected:
+    /** Declare interest in messages with the 'global_message' number (see
+     * GlobalMessageNumber).  By default, a builder receives all messages,
+     * once Subscribe() is called, it receives only the subscribed ones.
+     * This must be done before the builder is passed to ReadFitMessages().
+     */
+    void Subscribe(int global_message);
+
+    /** Declare whether the builder needs message timestamps.  If not, the
+     * reader does not keep track of them, which saves some work.
+     */
+    void SetNeedsTimestamps(bool need) { m_NeedsTimestamps = need; }
+
+    /** Declare whether the builder wants the developer fields of the
+     * messages it subscribed to.  This is off by default, and developer
+     * fields are skipped without decoding them.
+     */
+    void SetNeedsDeveloperFields(bool need) { m_NeedsDeveloperFields = need; }
+
+    /** Ask the reader to stop parsing after the current message. */
+    void RequestStop() { m_StopRequested = true; }
+
+private:
+    bool m_SubscribeAll;
+    bool m_NeedsTimestamps;
+    bool m_NeedsDeveloperFields;
+    bool m_StopRequested;
+    std::vector<bool> m_Subscribed;
+};
+
+class ParseContextState;                // Internal class
+
+/** Decoder state which is kept from one file to the next: the reader, with
+ * the storage for the message definitions, the developer field
+ * descriptions and the message builders.  Programs which parse many files
+ * can pass the same context to ReadFitMessages(), BuildFitIndex() and
+ * SeekToTime(), which then re-use this storage instead of allocating it
+ * again for every file and every chained FIT chunk.  Nothing is carried over
+ * between calls, the state is reset for each chunk.  A context can only be
+ * used by one thread at a time.
+ */
+class ParseContext
+{
+public:
+    ParseContext();
+    ~ParseContext();
+
+    /** The decoder state, used by the functions which take a context. */
+    ParseContextState* State() { return m_State.get(); }
+
+private:
+    ParseContext(const ParseContext&) = delete;
+    ParseContext& operator=(const ParseContext&) = delete;
+
+    std::unique_ptr<ParseContextState> m_State;
 };
 
 /** Read messages from the 'data' buffer and pass them to the FitBuilder
- * instance. */
-void ReadFitMessages(Buffer &data, FitBuilder *b);
+ * instance.  Returns true if all the messages were read, or false if the
+ * builder requested a stop. */
+bool ReadFitMessages(Buffer &data, FitBuilder *b);
+
+/** Same as above, but read the messages directly from 'length' bytes at
+ * 'data', for example a memory mapped file.  The data is not copied. */
+bool ReadFitMessages(const unsigned char *data, size_t length, FitBuilder *b);
+
+/** Same as above, using the decoder state in 'ctx'. */
+bool ReadFitMessages(const unsigned char *data, size_t length, FitBuilder *b, ParseContext &ctx);
+
+/** Same as above, but the data is decoded concurrently, using up to
+ * 'threads' threads (0 means one for each CPU core), but no more than the
+ * number of CPU cores.  The chunks of a chained FIT file are validated and
+ * decoded in parallel, and with three or more threads, large chunks are
+ * split into ranges of messages after a quick pass which reads only the
+ * message definitions.  The builder still receives the same callbacks, in
+ * file order and on the calling thread, as each chunk or range is
+ * completed.  Builders which stop early, such as file ID probes, should use
+ * the version above, which does not decode ahead. */
+bool ReadFitMessages(const unsigned char *data, size_t length, FitBuilder *b, unsigned threads);
+
+/** Same as above, but exactly 'threads' threads are used and chunks are
+ * split into ranges of messages if they are at least twice 'min_range_size'
+ * bytes, 0 means never.  This is exposed for benchmarking only (see
+ * bench/parallel-bench), the version above picks these from the number of
+ * CPU cores.
+ */
+bool ReadFitMessages(const unsigned char *data, size_t length, FitBuilder *b, unsigned threads,
+                     size_t min_range_size);
+
+/** An entry in a FitIndex: the state of the reader at the first message in
+ * a time bucket. */
+struct FitIndexEntry
+{
+    enum { MAX_DEFINITIONS = 16 };
+
+    /** Last timestamp seen before the message, in UNIX time.  Later messages
+     * have the same or a later timestamp. */
+    uint32_t Timestamp;
+    /** Local time minus UTC at that point, in seconds, INT32_MIN if not
+     * known. */
+    int32_t LocalOffset;
+    /** Offset of the FIT chunk in the file. */
+    uint32_t Chunk;
+    /** Position of the message in the chunk data. */
+    int Position;
+    /** Position of the active definition for each local message number in
+     * the chunk data, -1 if there is no definition. */
+    int Definitions[MAX_DEFINITIONS];
+};
+
+/** A timestamp index for a FIT file, see BuildFitIndex(). */
+struct FitIndex
+{
+    FitIndex() : FileSize(0), Bucket(0) {}
+
+    /** A developer_data_id or field_description message, these are read
+     * before decoding from an index entry. */
+    struct DevMessage {
+        uint32_t Chunk;
+        int Definition;
+        int Position;
+    };
+
+    /** Size of the indexed file, to check that the index matches it. */
+    uint64_t FileSize;
+    /** Time between index entries, in seconds. */
+    uint32_t Bucket;
+    std::vector<DevMessage> DevMessages;
+    std::vector<FitIndexEntry> Entries;
+};
+
+/** Build a timestamp index for the FIT data at 'data', with an entry for
+ * every 'bucket' seconds.  Each entry records where the messages for its
+ * time start and which message definitions are active there, so
+ * SeekToTime() can decode from that point without reading the messages
+ * before it.  Returns false if the data has no timestamps.
+ */
+bool BuildFitIndex(const unsigned char *data, size_t length, uint32_t bucket, FitIndex &index);
+bool BuildFitIndex(const unsigned char *data, size_t length, uint32_t bucket, FitIndex &index,
+                   ParseContext &ctx);
+
+/** Pass to the builder the messages with a timestamp between 'start' and
+ * 'end' (UNIX time).  Decoding starts from the last index entry before
+ * 'start' and stops at the first message after 'end'.  Message
+ * definitions and developer field descriptions are always processed, so
+ * the builder may receive field descriptions from outside the time window.
+ * If the index is not for this data, all of it is read.  Returns false if
+ * the builder requested a stop.
+ */
+bool SeekToTime(const unsigned char *data, size_t length, const FitIndex &index,
+                uint32_t start, uint32_t end, FitBuilder *b);
+bool SeekToTime(const unsigned char *data, size_t length, const FitIndex &index,
+                uint32_t start, uint32_t end, FitBuilder *b, ParseContext &ctx);
+
+/** Write an index to a stream, in a text format, and read it back.
+ * ReadFitIndex() returns false if the stream does not hold a valid index. */
+void WriteFitIndex(std::ostream &o, const FitIndex &index);
+bool ReadFitIndex(std::istream &in, FitIndex &index);
+
+class StreamParserState;                // Internal class
+
+/** Parse FIT data incrementally, as it arrives.  Data is passed to Feed()
+ * in chunks of any size and the FitBuilder receives its callbacks as soon as
+ * each message is complete.  Message definitions, an incomplete message at
+ * the end of a chunk and the running CRC are carried over between calls, so
+ * the whole file never needs to be in memory.  Chained FIT files are
+ * supported.
+ *
+ * Feed() and Finish() throw the same exceptions as ReadFitMessages() when
+ * the data is not valid.  Note that, unlike ReadFitMessages(), the chunk CRC
+ * is only checked once all of the chunk has arrived, after the callbacks for
+ * its messages have been made.  Once the builder requests a stop, any further
+ * data is ignored until Reset() is called.
+ */
+class StreamParser
+{
+public:
+    StreamParser(FitBuilder *b);
+    ~StreamParser();
+
+    /** Parse the next 'length' bytes of FIT data. */
+    void Feed(const unsigned char *data, size_t length);
+
+    /** Signal the end of the data, throws an exception if the data ended in
+     * the middle of a FIT chunk. */
+    void Finish();
+
+    /** Discard all state, ready to parse a new file. */
+    void Reset();
+
+private:
+    StreamParser(const StreamParser&) = delete;
+    StreamParser& operator=(const StreamParser&) = delete;
+
+    std::unique_ptr<StreamParserState> m_State;
+};
+
+/** Read the file ID message (and the file creator message, if 'creator' is
+ * not null) from the start of the FIT file at 'path'.  Only the header and
+ * the first few hundred bytes of the file are read, which is enough to
+ * identify a file without reading all of it.  Returns true if a file ID
+ * message was found.
+ *
+ * The payload CRC is not checked, unless 'verify_crc' is true, in which case
+ * the entire first chunk of the file is read and an exception is thrown if
+ * the CRC does not match.
+ */
+bool ProbeFileId(const std::string &path, FitFileId &fid,
+                 FitFileCreator *creator = nullptr, bool verify_crc = false);
+
+/** Same as above, but the start of the FIT file is in 'data'.  'data' can
+ * contain only a prefix of the file. */
+bool ProbeFileId(const unsigned char *data, size_t length,
+                 FitFileId &fid, FitFileCreator *creator = nullptr);
+
+/** Count the messages with the 'global_message' number in 'length' bytes
+ * of FIT data at 'data', for example to size a container before decoding
+ * them.  This is a quick pass which reads only the message headers and
+ * definitions, the CRC is not checked.  Invalid data is not reported, only
+ * the messages before it are counted.
+ */
+size_t CountFitMessages(const unsigned char *data, size_t length, int global_message);
 
 };                                      // end namespace fit
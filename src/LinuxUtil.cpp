@@ -1,12 +1,17 @@
 #include "LinuxUtil.h"
 
 #include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <map>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -41,14 +46,81 @@ namespace FitSync
         return m_Message.c_str();
     }
   
+    MappedFile::MappedFile(const std::string &file_name)
+        : m_Data(nullptr), m_Size(0), m_Mapped(false)
+    {
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw UnixException("MappedFile: open", errno);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            int e = errno;
+            ::close(fd);
+            throw UnixException("MappedFile: fstat", e);
+        }
+        m_Size = st.st_size;
+        if (m_Size > 0) {   // zero length mappings are not allowed
+            void *p = ::mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ::madvise(p, m_Size, MADV_SEQUENTIAL);
+                m_Data = static_cast<const unsigned char*>(p);
+                m_Mapped = true;
+            }
+            else if (errno == ENODEV || errno == EINVAL || errno == EACCES) {
+                // File system does not support mmap, read the file instead
+                m_Contents.resize(m_Size);
+                size_t pos = 0;
+                while (pos < m_Size) {
+                    int n = ::read(fd, &m_Contents[pos], m_Size - pos);
+                    if (n < 0) {
+                        int e = errno;
+                        ::close(fd);
+                        throw UnixException("MappedFile: read", e);
+                    }
+                    else if (n == 0) {
+                        break;
+                    }
+                    pos += n;
+                }
+                m_Contents.resize(pos);
+                m_Data = m_Contents.data();
+                m_Size = pos;
+            }
+            else {
+                int e = errno;
+                ::close(fd);
+                throw UnixException("MappedFile: mmap", e);
+            }
+        }
+        // The mapping remains valid after the file is closed
+        ::close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (m_Mapped)
+            ::munmap(const_cast<unsigned char*>(m_Data), m_Size);
+    }
+
+    void MappedFile::Load() const
+    {
+        if (! m_Mapped)
+            return;
+        // Touch a byte of every page
+        const volatile unsigned char *p = m_Data;
+        size_t page_size = ::sysconf(_SC_PAGESIZE);
+        unsigned char sum = 0;
+        for (size_t pos = 0; pos < m_Size; pos += page_size)
+            sum += p[pos];
+        (void) sum;
+    }
+
     void ReadData(const std::string &file_name, Buffer &data)
     {
-        // Read data in 10kb chunks.  Most FIT files should have less than one
-        // chunk.
-        const int chunk_size = 10 * 1024;
         // Limit file sizes, since we are on an embedded system (Raspberry
         // PI).  2 Mb FIT files would be very large, so we should be safe with
-        // this limit
+        // this limit.  Use MappedFile to access larger files.
         const int max_size = 2 * 1024 * 1024;
 
         data.clear();
@@ -56,53 +128,435 @@ namespace FitSync
         if (fd == -1) {
             throw UnixException("ReadData: open", errno);
         }
-        for (;;) {
-            unsigned mark = data.size();
-            data.resize(data.size() + chunk_size);
-            int n = ::read(fd, &data[mark], chunk_size);
+        struct stat st;
+        if (::fstat(fd, &st) == -1) {
+            int e = errno;
+            ::close(fd);
+            throw UnixException("ReadData: fstat", e);
+        }
+        if (st.st_size > max_size) {
+            ::close(fd);
+            throw std::runtime_error("ReadData: file too big");
+        }
+        // Size the buffer once, the file size is known
+        data.resize(st.st_size);
+        size_t pos = 0;
+        while (pos < data.size()) {
+            int n = ::read(fd, &data[pos], data.size() - pos);
             if (n < 0) {
+                int e = errno;
                 ::close(fd);
-                throw UnixException("ReadData: read", errno);
+                throw UnixException("ReadData: read", e);
             }
-            else if (n == 0) { // End of file
-                data.resize(mark);
+            else if (n == 0) { // End of file, it got shorter
                 break;
             }
-            else {
-                data.resize(mark + n);
-            }
-            if (data.size() > max_size) {
-                ::close(fd);
-                throw std::runtime_error("ReadData: file too big");
-            }
+            pos += n;
         }
+        data.resize(pos);
         ::close(fd);
     }
 
     void WriteData(const std::string &file_name, const Buffer &data)
     {
-        std::ostringstream tmp_file;
-        tmp_file << file_name << ".tmp";
-        int fd = ::open(tmp_file.str().c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        WriteData(file_name, data.data(), data.size());
+    }
+
+    void WriteData(const std::string &file_name, const unsigned char *data, size_t size)
+    {
+        WriteDataAt(AT_FDCWD, file_name, data, size);
+    }
+
+    /** Create a new temporary file for writing 'file_name', in the
+     * directory 'dir_fd', and return it open, its name is stored in
+     * 'tmp_file'.  The name is unique to the process and the call, so
+     * threads or processes writing the same file don't write into each
+     * other's temporary file.  Returns -1 on error, with errno set. */
+    static int CreateTmpFile(int dir_fd, const std::string &file_name, std::string &tmp_file)
+    {
+        static std::atomic<unsigned> counter(0);
+        for (;;) {
+            std::ostringstream name;
+            name << file_name << ".tmp." << ::getpid() << '.' << counter++;
+            tmp_file = name.str();
+            int fd = ::openat(dir_fd, tmp_file.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+            // A file left by a process which died with the same pid is
+            // skipped over
+            if (fd != -1 || errno != EEXIST)
+                return fd;
+        }
+    }
+
+    void RemoveStaleTmpFiles(int dir_fd)
+    {
+        int fd = ::openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return;
+        DIR *d = ::fdopendir(fd);
+        if (! d) {
+            ::close(fd);
+            return;
+        }
+        while (struct dirent *e = ::readdir(d)) {
+            // Temporary files are named FILE.tmp.PID.N, see CreateTmpFile()
+            const char *p = ::strstr(e->d_name, ".tmp.");
+            if (! p)
+                continue;
+            unsigned long pid = 0, n = 0;
+            int end = 0;
+            if (::sscanf(p, ".tmp.%lu.%lu%n", &pid, &n, &end) != 2 || p[end] != '\0')
+                continue;
+            // The files of a running process may still be committed
+            if (pid == static_cast<unsigned long>(::getpid())
+                || ::kill(pid, 0) == 0 || errno != ESRCH)
+                continue;
+            ::unlinkat(dir_fd, e->d_name, 0);
+        }
+        ::closedir(d);
+    }
+
+    /** Write 'data' to a new temporary file for 'file_name', in the
+     * directory 'dir_fd', and return the file, still open, its name is
+     * stored in 'tmp_file'.  The file is removed on error. */
+    static int WriteTmpFile(int dir_fd, const std::string &file_name, std::string &tmp_file,
+                            const unsigned char *data, size_t size)
+    {
+        int fd = CreateTmpFile(dir_fd, file_name, tmp_file);
         if (fd == -1) {
             throw UnixException("WriteData: open", errno);
         }
-        int n = ::write(fd, &data[0], data.size());
-        if (n == -1) {
-            ::close(fd);
-            throw UnixException("WriteData: write", errno);
+        size_t pos = 0;
+        while (pos < size) {
+            int n = ::write(fd, data + pos, size - pos);
+            if (n == -1) {
+                int e = errno;
+                ::close(fd);
+                ::unlinkat(dir_fd, tmp_file.c_str(), 0);
+                throw UnixException("WriteData: write", e);
+            }
+            else if (n == 0) {
+                ::close(fd);
+                ::unlinkat(dir_fd, tmp_file.c_str(), 0);
+                throw std::runtime_error("WriteData: short write");
+            }
+            pos += n;
         }
-        else if (n < static_cast<int>(data.size())) {
+        return fd;
+    }
+
+    /** Flush the open file 'fd' to disk, close it and rename it from
+     * 'tmp_file' to 'file_name'.  Without the flush, a power cut shortly
+     * after the rename can leave an empty file in place of the old one. */
+    static void SyncAndRename(int fd, int dir_fd, const std::string &tmp_file,
+                              const std::string &file_name, const char *who)
+    {
+        if (::fdatasync(fd) == -1) {
+            int e = errno;
             ::close(fd);
-            throw std::runtime_error("WriteData: short write");
+            ::unlinkat(dir_fd, tmp_file.c_str(), 0);
+            throw UnixException(std::string(who) + ": fdatasync", e);
         }
         ::close(fd);
 
-        int r = ::rename(tmp_file.str().c_str(), file_name.c_str());
+        int r = ::renameat(dir_fd, tmp_file.c_str(), dir_fd, file_name.c_str());
 
         if (r == -1) {
-            throw UnixException("WriteData: rename", errno);
+            throw UnixException(std::string(who) + ": rename", errno);
+        }
+    }
+
+    void WriteDataAt(int dir_fd, const std::string &file_name, const unsigned char *data, size_t size)
+    {
+        std::string tmp_file;
+        int fd = WriteTmpFile(dir_fd, file_name, tmp_file, data, size);
+        SyncAndRename(fd, dir_fd, tmp_file, file_name, "WriteData");
+    }
+
+    /** Copy the remaining contents of 'in' to 'out', starting at the current
+     * offset of both files.  The copy is done by the kernel if possible:
+     * copy_file_range() shares or copies the data inside the file system,
+     * sendfile() works between file systems, and if neither is supported
+     * the data is copied through a buffer.  'size' is the size of 'in', an
+     * exception is thrown if fewer bytes were copied.  Returns the number of
+     * bytes copied.
+     */
+    static size_t CopyFileData(int in, int out, size_t size)
+    {
+        // The most asked for in each call, all of a small file at once
+        const size_t chunk = std::max<size_t>(size, 64 * 1024);
+        size_t total = 0;
+
+        // Some file systems (FUSE and pseudo files, before Linux 5.19)
+        // return 0 from copy_file_range() before the end of the file, the
+        // copy then continues with sendfile() and read().
+        bool use_copy_file_range = true;
+        while (use_copy_file_range) {
+            ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+            if (n > 0) {
+                total += n;
+            } else if (n == 0) {
+                if (total >= size)
+                    return total;
+                use_copy_file_range = false;
+            } else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL
+                       || errno == EOPNOTSUPP || errno == EBADF) {
+                use_copy_file_range = false;
+            } else {
+                throw UnixException("CopyFile: copy_file_range", errno);
+            }
+        }
+
+        bool use_sendfile = true;
+        while (use_sendfile) {
+            ssize_t n = ::sendfile(out, in, nullptr, chunk);
+            if (n > 0) {
+                total += n;
+            } else if (n == 0) {
+                if (total >= size)
+                    return total;
+                use_sendfile = false;
+            } else if (errno == EINVAL || errno == ENOSYS) {
+                use_sendfile = false;
+            } else {
+                throw UnixException("CopyFile: sendfile", errno);
+            }
+        }
+
+        unsigned char buf[64 * 1024];
+        for (;;) {
+            ssize_t n = ::read(in, buf, sizeof(buf));
+            if (n < 0) {
+                throw UnixException("CopyFile: read", errno);
+            } else if (n == 0) {
+                break;
+            }
+            ssize_t pos = 0;
+            while (pos < n) {
+                ssize_t w = ::write(out, buf + pos, n - pos);
+                if (w == -1) {
+                    throw UnixException("CopyFile: write", errno);
+                }
+                else if (w == 0) {
+                    throw std::runtime_error("CopyFile: short write");
+                }
+                pos += w;
+            }
+            total += n;
+        }
+        if (total < size)
+            throw std::runtime_error("CopyFile: short copy, the file got shorter or could not be read");
+        return total;
+    }
+
+    size_t CopyFile(const std::string &source, const std::string &file_name)
+    {
+        return CopyFileAt(source, AT_FDCWD, file_name);
+    }
+
+    /** Copy 'source' to a new temporary file for 'file_name', in the
+     * directory 'dir_fd', and return the file, still open, its name is
+     * stored in 'tmp_file'.  The number of bytes copied is stored in 'size'.
+     * The file is removed on error. */
+    static int CopyToTmpFile(const std::string &source, int dir_fd, const std::string &file_name,
+                             std::string &tmp_file, size_t &size)
+    {
+        int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            throw UnixException("CopyFile: open", errno);
+        }
+        struct stat st;
+        if (::fstat(in, &st) == -1) {
+            int e = errno;
+            ::close(in);
+            throw UnixException("CopyFile: fstat", e);
+        }
+        ::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        int out = CreateTmpFile(dir_fd, file_name, tmp_file);
+        if (out == -1) {
+            int e = errno;
+            ::close(in);
+            throw UnixException("CopyFile: open", e);
+        }
+
+        try {
+            size = CopyFileData(in, out, st.st_size);
+        }
+        catch (...) {
+            ::close(in);
+            ::close(out);
+            ::unlinkat(dir_fd, tmp_file.c_str(), 0);
+            throw;
+        }
+        ::close(in);
+        return out;
+    }
+
+    size_t CopyFileAt(const std::string &source, int dir_fd, const std::string &file_name)
+    {
+        // Same as WriteData(), write a temporary file and rename it.
+        std::string tmp_file;
+        size_t size = 0;
+        int fd = CopyToTmpFile(source, dir_fd, file_name, tmp_file, size);
+        SyncAndRename(fd, dir_fd, tmp_file, file_name, "CopyFile");
+        return size;
+    }
+
+    bool FileExistsAt(int dir_fd, const std::string &file_name)
+    {
+        return ::faccessat(dir_fd, file_name.c_str(), F_OK, 0) == 0;
+    }
+
+    bool SameFileContents(const std::string &a, const std::string &b)
+    {
+        try {
+            MappedFile fa(a);
+            MappedFile fb(b);
+            return fa.Size() == fb.Size()
+                && (fa.Size() == 0 || ::memcmp(fa.Data(), fb.Data(), fa.Size()) == 0);
+        }
+        catch (std::exception &) {
+            return false;
+        }
+    }
+
+    bool LinkFileAt(const std::string &existing, int dir_fd, const std::string &file_name)
+    {
+        return ::linkat(AT_FDCWD, existing.c_str(), dir_fd, file_name.c_str(), 0) == 0;
+    }
+
+    int OpenDirectory(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            throw UnixException("open " + path, errno);
+        }
+        return fd;
+    }
+
+    WriteBatch::WriteBatch(size_t max_files, std::chrono::steady_clock::duration max_delay)
+        : m_MaxFiles(std::max<size_t>(max_files, 1)), m_MaxDelay(max_delay)
+    {
+        // empty
+    }
+
+    WriteBatch::~WriteBatch()
+    {
+        Discard();
+    }
+
+    void WriteBatch::WriteData(int dir_fd, const std::string &file_name,
+                               const unsigned char *data, size_t size, time_t mtime)
+    {
+        std::string tmp_file;
+        int fd = WriteTmpFile(dir_fd, file_name, tmp_file, data, size);
+        Add(fd, dir_fd, tmp_file, file_name, mtime);
+    }
+
+    size_t WriteBatch::CopyFile(const std::string &source, int dir_fd,
+                                const std::string &file_name, time_t mtime)
+    {
+        std::string tmp_file;
+        size_t size = 0;
+        int fd = CopyToTmpFile(source, dir_fd, file_name, tmp_file, size);
+        Add(fd, dir_fd, tmp_file, file_name, mtime);
+        return size;
+    }
+
+    void WriteBatch::Add(int fd, int dir_fd, const std::string &tmp_file,
+                         const std::string &file_name, time_t mtime)
+    {
+        Entry e;
+        e.Fd = fd;
+        e.DirFd = dir_fd;
+        e.TmpFile = tmp_file;
+        e.FileName = file_name;
+        struct stat st;
+        e.Device = (::fstat(fd, &st) == 0) ? st.st_dev : 0;
+        if (mtime != 0) {
+            struct timespec times[2];
+            times[0].tv_sec = times[1].tv_sec = mtime;
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            ::futimens(fd, times);
+        }
+        // A file written twice in a batch is only committed once, with the
+        // contents written last.
+        for (auto i = m_Entries.begin(); i != m_Entries.end(); ++i) {
+            if (i->DirFd == dir_fd && i->FileName == file_name) {
+                ::close(i->Fd);
+                ::unlinkat(i->DirFd, i->TmpFile.c_str(), 0);
+                m_Entries.erase(i);
+                break;
+            }
+        }
+        if (m_Entries.empty())
+            m_Started = std::chrono::steady_clock::now();
+        m_Entries.push_back(e);
+    }
+
+    std::chrono::steady_clock::duration WriteBatch::TimeLeft() const
+    {
+        if (m_Entries.empty())
+            return m_MaxDelay;
+        return m_Started + m_MaxDelay - std::chrono::steady_clock::now();
+    }
+
+    void WriteBatch::Commit()
+    {
+        if (m_Entries.empty())
+            return;
+
+        // Flush the file data: a file system with several files in the
+        // batch is flushed with a single syncfs(), the others have their
+        // file flushed on its own.
+        std::map<dev_t, int> files_on_device;
+        for (const auto &e : m_Entries)
+            files_on_device[e.Device]++;
+        std::map<dev_t, bool> device_synced;
+        for (const auto &e : m_Entries) {
+            int r = 0;
+            if (files_on_device[e.Device] == 1)
+                r = ::fdatasync(e.Fd);
+            else if (! device_synced[e.Device]) {
+                r = ::syncfs(e.Fd);
+                device_synced[e.Device] = true;
+            }
+            if (r == -1) {
+                int err = errno;
+                Discard();
+                throw UnixException("WriteBatch: sync", err);
+            }
+        }
+
+        // Only now that the data is on disk, the files replace the old ones.
+        // The directories are flushed last, so the renames are on disk too.
+        std::vector<int> dirs;
+        int error = 0;
+        for (const auto &e : m_Entries) {
+            ::close(e.Fd);
+            int r = ::renameat(e.DirFd, e.TmpFile.c_str(), e.DirFd, e.FileName.c_str());
+            if (r == -1 && error == 0)
+                error = errno;
+            if (std::find(dirs.begin(), dirs.end(), e.DirFd) == dirs.end())
+                dirs.push_back(e.DirFd);
+        }
+        m_Entries.clear();
+        if (error != 0)
+            throw UnixException("WriteBatch: rename", error);
+
+        for (int dir_fd : dirs) {
+            if (::fsync(dir_fd) == -1)
+                throw UnixException("WriteBatch: fsync", errno);
+        }
+    }
+
+    void WriteBatch::Discard()
+    {
+        for (const auto &e : m_Entries) {
+            ::close(e.Fd);
+            ::unlinkat(e.DirFd, e.TmpFile.c_str(), 0);
         }
+        m_Entries.clear();
     }
 
     void MakeDirectoryPath(const std::string &path)
@@ -5,6 +5,10 @@
 #include <vector>
 #include <string>
 #include <exception>
+#include <chrono>
+
+#include <sys/types.h>
+#include <time.h>
 
 namespace FitSync 
 {
@@ -25,6 +29,37 @@ namespace FitSync
         mutable bool m_MessageDone;
     };
 
+    /** A read-only memory mapping of an entire file.  The file contents
+     * can be accessed in place, without copying them into a Buffer, and
+     * there is no limit on the file size.  The mapping is advised for
+     * sequential access, so the kernel reads ahead and drops pages behind.
+     * If the file system does not support mmap (some FUSE file systems
+     * don't), the file is read into memory instead.
+     */
+    class MappedFile
+    {
+    public:
+        MappedFile(const std::string &file_name);
+        ~MappedFile();
+
+        const unsigned char* Data() const { return m_Data; }
+        size_t Size() const { return m_Size; }
+
+        /** Read all of the file now, instead of as its pages are first
+         * accessed, for example to read it from a slow device on another
+         * thread than the one using the data. */
+        void Load() const;
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char *m_Data;
+        size_t m_Size;
+        bool m_Mapped;
+        Buffer m_Contents;              // used when mmap is not supported
+    };
+
     /** Read the contents of file_name into data.  An exception is thrown if
      * there is a problem, in which case the contents of 'data' is
      * undefined.
@@ -32,9 +67,116 @@ namespace FitSync
     void ReadData(const std::string &file_name, Buffer &data);
 
     /** Write the contents of 'data' to 'file_name'.  This is done such that
-     * there is a minimal chance of having partial data written to disk.
+     * there is a minimal chance of having partial data written to disk: the
+     * data goes into a temporary file, which is flushed to disk and renamed
+     * over 'file_name'.  Use a WriteBatch to write many files.
      */
     void WriteData(const std::string &file_name, const Buffer &data);
+    void WriteData(const std::string &file_name, const unsigned char *data, size_t size);
+
+    /** Same as WriteData(), with 'file_name' relative to the directory open
+     * as 'dir_fd'. */
+    void WriteDataAt(int dir_fd, const std::string &file_name, const unsigned char *data, size_t size);
+
+    /** Copy the file 'source' to 'file_name', the same way WriteData()
+     * writes it.  The data is copied by the kernel when possible, without
+     * passing through a user space buffer.  Returns the number of bytes
+     * copied.
+     */
+    size_t CopyFile(const std::string &source, const std::string &file_name);
+
+    /** Same as CopyFile(), with 'file_name' relative to the directory open
+     * as 'dir_fd'. */
+    size_t CopyFileAt(const std::string &source, int dir_fd, const std::string &file_name);
+
+    /** Write several files such that each of them is either fully written
+     * or not there at all, even after a power cut, for the cost of a few
+     * flushes per batch instead of one per file.
+     *
+     * WriteData() and CopyFile() write the data into temporary files, which
+     * are kept open.  The temporary names are unique, so several batches,
+     * in this or other processes, can write the same file, the last rename
+     * wins.  Adding a file name already in the batch replaces the earlier
+     * file.  Commit() flushes them all to disk, renames them to
+     * their final names and flushes the directories.  Commit() should be
+     * called when Full() or when TimeLeft() runs out, and before the batch
+     * is destroyed: files not committed are removed.  Directories are
+     * passed as open descriptors, see GetFileStorageDir().
+     */
+    class WriteBatch
+    {
+    public:
+        WriteBatch(size_t max_files, std::chrono::steady_clock::duration max_delay);
+        ~WriteBatch();
+
+        /** Add 'file_name' in 'dir_fd' with the contents 'data'.  If
+         * 'mtime' is not 0, it is set as the access and modification time
+         * of the file. */
+        void WriteData(int dir_fd, const std::string &file_name,
+                       const unsigned char *data, size_t size, time_t mtime = 0);
+
+        /** Add 'file_name' in 'dir_fd' as a copy of 'source', see
+         * CopyFile().  Returns the number of bytes copied. */
+        size_t CopyFile(const std::string &source, int dir_fd,
+                        const std::string &file_name, time_t mtime = 0);
+
+        size_t Size() const { return m_Entries.size(); }
+        bool Full() const { return m_Entries.size() >= m_MaxFiles; }
+
+        /** Time until the first file in the batch is due to be committed. */
+        std::chrono::steady_clock::duration TimeLeft() const;
+
+        /** Make all files in the batch durable and rename them in place.  On
+         * error, an exception is thrown and none of the files are
+         * guaranteed to be written. */
+        void Commit();
+
+        /** Drop all files in the batch. */
+        void Discard();
+
+    private:
+        WriteBatch(const WriteBatch&) = delete;
+        WriteBatch& operator=(const WriteBatch&) = delete;
+
+        void Add(int fd, int dir_fd, const std::string &tmp_file,
+                 const std::string &file_name, time_t mtime);
+
+        struct Entry {
+            int Fd;                     // the temporary file, still open
+            int DirFd;
+            dev_t Device;
+            std::string TmpFile;
+            std::string FileName;
+        };
+
+        size_t m_MaxFiles;
+        std::chrono::steady_clock::duration m_MaxDelay;
+        std::chrono::steady_clock::time_point m_Started;
+        std::vector<Entry> m_Entries;
+    };
+
+    /** Remove the temporary files left in the directory open as 'dir_fd' by
+     * WriteData(), CopyFile() or a WriteBatch in a process which is no longer
+     * running, for example after a power cut. */
+    void RemoveStaleTmpFiles(int dir_fd);
+
+    /** Return true if 'file_name', relative to the directory open as
+     * 'dir_fd', exists. */
+    bool FileExistsAt(int dir_fd, const std::string &file_name);
+
+    /** Return true if the files 'a' and 'b' have the same contents, false
+     * if they differ or one of them cannot be read. */
+    bool SameFileContents(const std::string &a, const std::string &b);
+
+    /** Create 'file_name', relative to the directory open as 'dir_fd', as a
+     * hard link to the file 'existing'.  Returns false if the link could
+     * not be created, for example because the files are on different file
+     * systems. */
+    bool LinkFileAt(const std::string &existing, int dir_fd, const std::string &file_name);
+
+    /** Open the directory 'path' for use with the *At() functions.  The
+     * caller owns the returned file descriptor. */
+    int OpenDirectory(const std::string &path);
 
     /** Make sure that all directories in 'path' exist (create them if they
      * don't)
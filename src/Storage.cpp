@@ -3,6 +3,7 @@
 
 #include "AntMessage.h"
 #include "Storage.h"
+#include "FileCatalog.h"
 
 #include <string>
 #include <vector>
@@ -11,6 +12,14 @@
 #include <sstream>
 #include <stdexcept>
 #include <map>
+#include <memory>
+#include <mutex>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace FitSync;
 
@@ -19,10 +28,31 @@ namespace {
     std::string g_BaseDirectory;
 
     const char *g_KeyFileName = "auth_key.dat";
+    const char *g_CatalogFileName = "catalog.txt";
     const char *g_AppName = "FitSync";
 
     std::map<unsigned, time_t> g_LastSuccessfulSync;
 
+    // Protects g_BaseDirectory and g_StorageDirs, storage paths are looked
+    // up from several threads by fit-sync-usb.
+    std::mutex g_StorageMutex;
+
+    /** A storage directory, created the first time it is used and kept open
+     * until the process exits.  The device and inode of the open directory
+     * are kept to notice when it is removed or replaced. */
+    struct StorageDir {
+        std::string Path;
+        int Fd;
+        dev_t Device;
+        ino_t Inode;
+    };
+
+    // Storage directories, by device serial number and sub-directory name;
+    // the device directory itself has an empty name.
+    std::map<std::pair<unsigned, std::string>, StorageDir> g_StorageDirs;
+
+    std::unique_ptr<FileCatalog> g_Catalog;
+
     // Map an FIT file type to a directory where we store it.
     struct FileTypeMap {
         AntfsFileSubType m_Type;
@@ -72,6 +102,62 @@ namespace {
         return "Unknown";
     }
 
+    /** Create the directory 'd.Path' if needed and open it, the descriptor
+     * is stored in 'd.Fd'.  Temporary files left by an interrupted write are
+     * removed. */
+    void OpenStorageDir(StorageDir &d)
+    {
+        MakeDirectoryPath(d.Path);
+        int fd = OpenDirectory(d.Path);
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            int error = errno;
+            close(fd);
+            throw UnixException("stat " + d.Path, error);
+        }
+        d.Device = st.st_dev;
+        d.Inode = st.st_ino;
+        RemoveStaleTmpFiles(fd);
+        if (d.Fd == -1) {
+            d.Fd = fd;
+        } else {
+            // Other threads may be using the old descriptor, which is
+            // replaced, not closed, so it can't be reused for another file.
+            dup3(fd, d.Fd, O_CLOEXEC);
+            close(fd);
+        }
+    }
+
+    /** Return the directory 'name' for the device 'device_serial', creating
+     * and opening it on first use.  The directories are removed or renamed
+     * by hand at times (they are shared over the network), a cached
+     * directory which is no longer at its path is created and opened again.
+     * g_StorageMutex must be held. */
+    const StorageDir& GetStorageDir(unsigned device_serial, const std::string &name)
+    {
+        auto key = std::make_pair(device_serial, name == "." ? std::string() : name);
+        auto i = g_StorageDirs.find(key);
+        if (i != g_StorageDirs.end()) {
+            StorageDir &d = i->second;
+            struct stat st;
+            if (stat(d.Path.c_str(), &st) == -1
+                || st.st_dev != d.Device || st.st_ino != d.Inode)
+                OpenStorageDir(d);
+            return d;
+        }
+
+        if (g_BaseDirectory == "") Init();
+        std::ostringstream p;
+        p << g_BaseDirectory << '/' << device_serial;
+        if (! key.second.empty())
+            p << '/' << key.second;
+        StorageDir d;
+        d.Path = p.str();
+        d.Fd = -1;
+        OpenStorageDir(d);
+        return g_StorageDirs[key] = d;
+    }
+
 };                                      // end anonymous namespace
 
 namespace FitSync 
@@ -79,28 +165,43 @@ namespace FitSync
 
     std::string GetBaseStoragePath()
     {
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
         if (g_BaseDirectory == "") Init();
         return g_BaseDirectory;
     }
 
     std::string GetDeviceStoragePath(unsigned device_serial)
     {
-        if (g_BaseDirectory == "") Init();
-        std::ostringstream p;
-        p << g_BaseDirectory << "/" << device_serial;
-        std::string path = p.str();
-        MakeDirectoryPath(path);
-        return path;
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
+        return GetStorageDir(device_serial, "").Path;
     }
 
     std::string GetFileStoragePath(unsigned device_serial, AntfsFileSubType t)
     {
-        if (g_BaseDirectory == "") Init();
-        std::ostringstream p;
-        p << g_BaseDirectory << '/' << device_serial << '/' << GetDirForFileType(t);
-        std::string path = p.str();
-        MakeDirectoryPath(path);
-        return path;
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
+        return GetStorageDir(device_serial, GetDirForFileType(t)).Path;
+    }
+
+    int GetDeviceStorageDir(unsigned device_serial)
+    {
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
+        return GetStorageDir(device_serial, "").Fd;
+    }
+
+    int GetFileStorageDir(unsigned device_serial, AntfsFileSubType t)
+    {
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
+        return GetStorageDir(device_serial, GetDirForFileType(t)).Fd;
+    }
+
+    FileCatalog& GetFileCatalog()
+    {
+        std::lock_guard<std::mutex> lock(g_StorageMutex);
+        if (! g_Catalog) {
+            if (g_BaseDirectory == "") Init();
+            g_Catalog.reset(new FileCatalog(g_BaseDirectory + '/' + g_CatalogFileName));
+        }
+        return *g_Catalog;
     }
 
     void PutKey (unsigned device_serial, const Buffer &key)
@@ -5,10 +5,23 @@
 
 namespace FitSync
 {
+    class FileCatalog;
+
     std::string GetBaseStoragePath();
     std::string GetDeviceStoragePath(unsigned device_serial);
     std::string GetFileStoragePath(unsigned device_serial, AntfsFileSubType t);
 
+    /** Storage directories open for use with WriteDataAt() and the other
+     * *At() functions.  Each directory is created and opened once, the
+     * first time it is asked for, and stays open until the process exits:
+     * callers must not close the returned descriptors. */
+    int GetDeviceStorageDir(unsigned device_serial);
+    int GetFileStorageDir(unsigned device_serial, AntfsFileSubType t);
+
+    /** The catalog of the files in the storage directory, opened on first
+     * use. */
+    FileCatalog& GetFileCatalog();
+
     void PutKey (unsigned device_serial, const Buffer &key);
     Buffer GetKey(unsigned device_serial);
     void RemoveKey(unsigned device_serial);
@@ -0,0 +1,136 @@
+#include "SyncManifest.h"
+#include "LinuxUtil.h"
+#include "Storage.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <limits.h>
+#include <stdlib.h>
+
+namespace {
+
+    const char *g_ManifestHeader = "FITSYNC-MANIFEST 2";
+
+};                                      // end anonymous namespace
+
+namespace FitSync
+{
+
+    SyncManifest::SyncManifest(const std::string &file_name)
+        : m_FileName(file_name), m_Pending(0), m_Dirty(false)
+    {
+        // empty
+    }
+
+    int64_t SyncManifest::ModificationTime(const struct stat &st)
+    {
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    void SyncManifest::Load()
+    {
+        m_Entries.clear();
+        m_SeenDevices.clear();
+        // A manifest from an older version is ignored, as it has no serial
+        // numbers.
+        std::ifstream in(m_FileName.c_str());
+        std::string line;
+        if (! in || ! std::getline(in, line) || line != g_ManifestHeader)
+            return;
+        // Each line is: c|s SIZE MTIME SERIAL PATH, the path runs to the end
+        // of the line.
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            char status = 0;
+            Entry e;
+            fields >> status >> e.Size >> e.ModificationTime >> e.SerialNumber;
+            fields.get();               // the space before the path
+            std::string path;
+            std::getline(fields, path);
+            if (! fields.eof() || path.empty() || (status != 'c' && status != 's')) {
+                // a damaged manifest, forget it and process all files.
+                m_Entries.clear();
+                return;
+            }
+            e.Copied = (status == 'c');
+            e.Seen = false;
+            m_Entries[path] = e;
+        }
+    }
+
+    void SyncManifest::Save(bool prune)
+    {
+        if (prune) {
+            for (auto i = m_Entries.begin(); i != m_Entries.end(); ) {
+                if (i->second.Seen || m_SeenDevices.count(i->second.SerialNumber) == 0) {
+                    ++i;
+                } else {
+                    i = m_Entries.erase(i);
+                    m_Dirty = true;
+                }
+            }
+        }
+        if (! m_Dirty)
+            return;
+        std::ostringstream o;
+        o << g_ManifestHeader << "\n";
+        for (const auto &i : m_Entries) {
+            o << (i.second.Copied ? 'c' : 's') << ' ' << i.second.Size
+              << ' ' << i.second.ModificationTime << ' ' << i.second.SerialNumber
+              << ' ' << i.first << "\n";
+        }
+        std::string data = o.str();
+        WriteData(m_FileName, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+        m_Pending = 0;
+        m_Dirty = false;
+    }
+
+    bool SyncManifest::IsUnchanged(const std::string &path, const struct stat &st, bool copied_only)
+    {
+        auto i = m_Entries.find(path);
+        if (i == m_Entries.end())
+            return false;
+        // The file is still there, even if it changed
+        i->second.Seen = true;
+        m_SeenDevices.insert(i->second.SerialNumber);
+        return i->second.Size == static_cast<uint64_t>(st.st_size)
+            && i->second.ModificationTime == ModificationTime(st)
+            && (i->second.Copied || ! copied_only);
+    }
+
+    void SyncManifest::Record(const std::string &path, const struct stat &st,
+                              uint32_t serial_number, bool copied)
+    {
+        // Paths are stored one per line
+        if (path.find('\n') != std::string::npos)
+            return;
+        Entry e;
+        e.Size = st.st_size;
+        e.ModificationTime = ModificationTime(st);
+        e.SerialNumber = serial_number;
+        e.Copied = copied;
+        e.Seen = true;
+        m_Entries[path] = e;
+        m_SeenDevices.insert(serial_number);
+        m_Pending++;
+        m_Dirty = true;
+    }
+
+    std::string GetSyncManifestPath(const std::string &source_dir)
+    {
+        // Name the manifest after the absolute path of the directory, the
+        // devices mounted there are told apart by the serial numbers in the
+        // entries.
+        char buf[PATH_MAX];
+        std::string name = realpath(source_dir.c_str(), buf) ? buf : source_dir;
+        for (auto &c : name) {
+            if (c == '/' || c == ' ')
+                c = '_';
+        }
+        std::string dir = GetBaseStoragePath() + "/manifests";
+        MakeDirectoryPath(dir);
+        return dir + "/" + name + ".manifest";
+    }
+
+};                                      // end namespace FitSync
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace FitSync
+{
+    /** The files already synced from a directory, keyed by their path
+     * relative to it.  The size and modification time of each file are
+     * recorded, and a file whose size and modification time have not changed
+     * since it was recorded can be skipped without opening it.
+     *
+     * Several devices can be mounted on the same directory, one after the
+     * other, so each file also records the serial number of the device which
+     * created it (from its FIT file ID), and only entries for the devices
+     * seen in a scan are pruned by it.
+     *
+     * The manifest is a text file, saved by writing a new copy and renaming
+     * it over the old one, so it is never left half written.  A file is only
+     * recorded after it has been processed, so a run which is interrupted
+     * processes again only the files it had not recorded yet.  A manifest
+     * which cannot be read is ignored, and all files are processed.
+     */
+    class SyncManifest
+    {
+    public:
+        SyncManifest(const std::string &file_name);
+
+        /** Load the manifest file, if it exists. */
+        void Load();
+
+        /** Save the manifest, if it changed.  When 'prune' is true, entries
+         * for files which were not looked up or recorded since the manifest
+         * was loaded (that is, files no longer on the device) are dropped
+         * first; only do this after a complete scan.  Entries are only
+         * dropped for devices which had a file looked up or recorded, the
+         * files of another device using the same directory are kept.
+         */
+        void Save(bool prune);
+
+        /** Return true if 'path' is recorded with the size and modification
+         * time in 'st'.  When 'copied_only' is true, files which were
+         * recorded as skipped don't count.
+         */
+        bool IsUnchanged(const std::string &path, const struct stat &st, bool copied_only);
+
+        /** Return true if 'path' is recorded, changed or not. */
+        bool Contains(const std::string &path) const { return m_Entries.count(path) > 0; }
+
+        /** Record that 'path', with the size and modification time in 'st',
+         * and created by the device with 'serial_number', was processed.
+         * 'copied' is false if the file was not copied because of its type.
+         */
+        void Record(const std::string &path, const struct stat &st,
+                    uint32_t serial_number, bool copied);
+
+        /** Number of files recorded since the last Save(). */
+        int Pending() const { return m_Pending; }
+
+    private:
+        struct Entry {
+            uint64_t Size;
+            int64_t ModificationTime;   // nanoseconds
+            uint32_t SerialNumber;
+            bool Copied;
+            bool Seen;
+        };
+
+        static int64_t ModificationTime(const struct stat &st);
+
+        std::string m_FileName;
+        std::unordered_map<std::string, Entry> m_Entries;
+        /** Serial numbers of the entries looked up or recorded. */
+        std::unordered_set<uint32_t> m_SeenDevices;
+        int m_Pending;
+        bool m_Dirty;
+    };
+
+    /** Return the manifest file used for syncing the directory 'source_dir',
+     * which is kept in the base storage directory. */
+    std::string GetSyncManifestPath(const std::string &source_dir);
+
+};                                      // end namespace FitSync
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
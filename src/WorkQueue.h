@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace FitSync
+{
+    /** A queue passing work between threads, for example from one stage of
+     * a pipeline to the next.  The queue holds at most 'capacity' items:
+     * Push() blocks while it is full, so a fast producer does not get too far
+     * ahead of its consumers.  Pop() blocks until an item is available, or
+     * the queue is closed, which is how consumers find out that there is no
+     * more work.
+     */
+    template <typename T>
+    class WorkQueue
+    {
+    public:
+        WorkQueue(size_t capacity) : m_Capacity(capacity), m_Closed(false) {}
+
+        /** Add 'item' at the end of the queue, waiting for room if needed. */
+        void Push(T item)
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_NotFull.wait(lock, [this] { return m_Items.size() < m_Capacity; });
+            m_Items.push_back(std::move(item));
+            m_NotEmpty.notify_one();
+        }
+
+        /** Move the first item in the queue into 'item'.  Returns false if
+         * the queue is closed and there are no items left. */
+        bool Pop(T &item)
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            m_NotEmpty.wait(lock, [this] { return ! m_Items.empty() || m_Closed; });
+            if (m_Items.empty())
+                return false;
+            item = std::move(m_Items.front());
+            m_Items.pop_front();
+            m_NotFull.notify_one();
+            return true;
+        }
+
+        enum class PopResult { Item, Timeout, Closed };
+
+        /** Same as Pop(), but wait at most 'timeout' for an item. */
+        PopResult PopFor(T &item, std::chrono::steady_clock::duration timeout)
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if (! m_NotEmpty.wait_for(lock, timeout, [this] { return ! m_Items.empty() || m_Closed; }))
+                return PopResult::Timeout;
+            if (m_Items.empty())
+                return PopResult::Closed;
+            item = std::move(m_Items.front());
+            m_Items.pop_front();
+            m_NotFull.notify_one();
+            return PopResult::Item;
+        }
+
+        /** Signal that no more items will be pushed.  Consumers receive the
+         * items already queued. */
+        void Close()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Closed = true;
+            m_NotEmpty.notify_all();
+        }
+
+    private:
+        WorkQueue(const WorkQueue&) = delete;
+        WorkQueue& operator=(const WorkQueue&) = delete;
+
+        size_t m_Capacity;
+        bool m_Closed;
+        std::deque<T> m_Items;
+        std::mutex m_Mutex;
+        std::condition_variable m_NotEmpty;
+        std::condition_variable m_NotFull;
+    };
+
+};                                      // end namespace FitSync
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
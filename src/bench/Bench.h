@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+namespace bench {
+
+/** Run 'f' 'runs' times and return the fastest run, in milliseconds.  The
+ * fastest run is the one least disturbed by the rest of the system.
+ */
+template <typename F>
+double BestOf(int runs, F f)
+{
+    double best = 0;
+    for (int i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        if (i == 0 || ms.count() < best)
+            best = ms.count();
+    }
+    return best;
+}
+
+};                                      // end namespace bench
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace bench {
+
+/** The CRC-16 from the FIT SDK, processing 4 bits at a time, which is what
+ * FitFile.cpp used before Crc16.cpp.  The kernels in Crc16.cpp must produce
+ * the same values.
+ */
+inline uint16_t NibbleCrc16Update(uint16_t crc, const unsigned char *data, size_t len)
+{
+    static const uint16_t crc_table[16] = {
+        0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+        0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+    };
+
+    while (len--) {
+        unsigned char byte = *data++;
+
+        // compute checksum of lower four bits of byte
+        uint16_t tmp = crc_table[crc & 0xF];
+        crc = (crc >> 4) & 0x0FFF;
+        crc = crc ^ tmp ^ crc_table[byte & 0xF];
+
+        // now compute checksum of upper four bits of byte
+        tmp = crc_table[crc & 0xF];
+        crc = (crc >> 4) & 0x0FFF;
+        crc = crc ^ tmp ^ crc_table[(byte >> 4) & 0xF];
+    }
+    return crc;
+}
+
+};                                      // end namespace bench
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
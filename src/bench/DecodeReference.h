@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace bench {
+
+/** DecodeAs() as it was before FitDecode.h: the value is assembled one byte
+ * at a time, in reverse order if needed.  bench/decode-bench compares the
+ * two.
+ */
+template <typename BT> BT ByteDecodeAs (const unsigned char *data, bool revert)
+{
+    union {
+        BT b;
+        uint8_t d[sizeof(BT)];
+    } val;
+
+    if (revert) {
+        for (size_t i = 0; i < sizeof(BT); ++i)
+            val.d[i] = data[sizeof(BT) - 1 - i];
+    } else {
+        for (size_t i = 0; i < sizeof(BT); ++i)
+            val.d[i] = data[i];
+    }
+    return val.b;
+}
+
+/** Array fields were decoded one element at a time, with the above. */
+template <typename BT> void ByteDecodeArrayAs (const unsigned char *data, int count, bool revert, BT *out)
+{
+    for (int i = 0; i < count; ++i)
+        out[i] = ByteDecodeAs<BT>(data + i * sizeof(BT), revert);
+}
+
+};                                      // end namespace bench
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "../Crc16.h"
+
+#include <stdint.h>
+#include <vector>
+
+namespace bench {
+
+typedef std::vector<unsigned char> Bytes;
+
+/** A field in a message definition: field number, size in bytes and FIT
+ * base type. */
+struct FieldDef {
+    unsigned char Number;
+    unsigned char Size;
+    unsigned char BaseType;
+};
+
+/** Writes synthetic FIT data for the benchmarks and tests, so they don't
+ * depend on sample files.  Messages are added to the current chunk with
+ * Define() and Begin() followed by Put() for each field value, Chunk()
+ * returns the chunk, with its header and CRCs.
+ */
+class FitWriter
+{
+public:
+    FitWriter() : m_BigEndian() {}
+
+    /** Add a definition message for 'local' as the 'global' message. */
+    void Define(int local, int global, const std::vector<FieldDef> &fields,
+                bool big_endian = false, const std::vector<FieldDef> &dev_fields = {})
+        {
+            m_Data.push_back(0x40 | local | (dev_fields.empty() ? 0 : 0x20));
+            m_Data.push_back(0);
+            m_Data.push_back(big_endian ? 1 : 0);
+            m_BigEndian[local] = big_endian;
+            m_Local = local;
+            Put<uint16_t>(global);
+            m_Data.push_back(fields.size());
+            for (const auto &f : fields)
+                m_Data.insert(m_Data.end(), { f.Number, f.Size, f.BaseType });
+            if (! dev_fields.empty()) {
+                m_Data.push_back(dev_fields.size());
+                // for developer fields the third byte is the developer data
+                // index
+                for (const auto &f : dev_fields)
+                    m_Data.insert(m_Data.end(), { f.Number, f.Size, f.BaseType });
+            }
+        }
+
+    /** Start a data message for 'local', with a compressed timestamp header
+     * if 'time_offset' is not negative. */
+    void Begin(int local, int time_offset = -1)
+        {
+            m_Local = local;
+            if (time_offset >= 0)
+                m_Data.push_back(0x80 | (local << 5) | (time_offset & 0x1F));
+            else
+                m_Data.push_back(local);
+        }
+
+    /** Append a value in the byte order of the current message. */
+    template <typename T>
+    void Put(T value)
+        {
+            unsigned char b[sizeof(T)];
+            for (size_t i = 0; i < sizeof(T); i++)
+                b[i] = static_cast<uint64_t>(value) >> (8 * i);
+            for (size_t i = 0; i < sizeof(T); i++)
+                m_Data.push_back(m_BigEndian[m_Local] ? b[sizeof(T) - 1 - i] : b[i]);
+        }
+
+    void PutString(const char *s, size_t size)
+        {
+            for (size_t i = 0; i < size; i++) {
+                m_Data.push_back(*s);
+                if (*s)
+                    s++;
+            }
+        }
+
+    /** Return the messages added so far as a FIT chunk, and start a new
+     * one. */
+    Bytes Chunk()
+        {
+            Bytes c = { 14, 0x20, 0x54, 0x08, 0, 0, 0, 0, '.', 'F', 'I', 'T', 0, 0 };
+            uint32_t size = m_Data.size();
+            for (int i = 0; i < 4; i++)
+                c[4 + i] = size >> (8 * i);
+            uint16_t crc = fit::Crc16(c.data(), 12);
+            c[12] = crc & 0xFF;
+            c[13] = crc >> 8;
+            c.insert(c.end(), m_Data.begin(), m_Data.end());
+            crc = fit::Crc16(c.data(), c.size());
+            c.push_back(crc & 0xFF);
+            c.push_back(crc >> 8);
+            m_Data.clear();
+            return c;
+        }
+
+private:
+    Bytes m_Data;
+    bool m_BigEndian[16];
+    int m_Local = 0;
+};
+
+/** Options for MakeActivity(). */
+struct ActivityOptions {
+    /** Number of record messages. */
+    int Records = 3600;
+    bool BigEndian = false;
+    /** Two developer fields, power and form power, in each record. */
+    bool DeveloperFields = false;
+    /** A developer array field of this many uint16 values in each record,
+     * 0 for none. */
+    int DeveloperArray = 0;
+    uint32_t StartTime = 1000000000;    // FIT time
+};
+
+/** Return a FIT activity chunk with a file ID, a start and stop event and
+ * 'opt.Records' one second record messages, similar to what a watch
+ * records. */
+inline Bytes MakeActivity(const ActivityOptions &opt)
+{
+    FitWriter w;
+    w.Define(0, 0, { { 0, 1, 0x00 }, { 1, 2, 0x84 }, { 2, 2, 0x84 },
+                     { 3, 4, 0x8C }, { 4, 4, 0x86 } });
+    w.Begin(0);
+    w.Put<uint8_t>(4);                  // activity
+    w.Put<uint16_t>(1);                 // garmin
+    w.Put<uint16_t>(3113);
+    w.Put<uint32_t>(3916163708u);
+    w.Put<uint32_t>(opt.StartTime);
+
+    std::vector<FieldDef> dev;
+    if (opt.DeveloperFields || opt.DeveloperArray > 0) {
+        w.Define(1, 207, { { 3, 1, 0x02 } });  // developer_data_id
+        w.Begin(1);
+        w.Put<uint8_t>(0);
+        w.Define(1, 206, { { 0, 1, 0x02 }, { 1, 1, 0x02 }, { 2, 1, 0x02 },
+                           { 3, 16, 0x07 } });  // field_description
+        if (opt.DeveloperFields) {
+            w.Begin(1);
+            w.Put<uint8_t>(0); w.Put<uint8_t>(0); w.Put<uint8_t>(0x84);
+            w.PutString("Power", 16);
+            w.Begin(1);
+            w.Put<uint8_t>(0); w.Put<uint8_t>(1); w.Put<uint8_t>(0x02);
+            w.PutString("Form Power", 16);
+            dev.push_back({ 0, 2, 0 });
+            dev.push_back({ 1, 1, 0 });
+        }
+        if (opt.DeveloperArray > 0) {
+            w.Begin(1);
+            w.Put<uint8_t>(0); w.Put<uint8_t>(2); w.Put<uint8_t>(0x84);
+            w.PutString("Samples", 16);
+            dev.push_back({ 2, static_cast<unsigned char>(2 * opt.DeveloperArray), 0 });
+        }
+    }
+
+    w.Define(2, 21, { { 253, 4, 0x86 }, { 0, 1, 0x00 }, { 1, 1, 0x00 } });
+    w.Begin(2);
+    w.Put<uint32_t>(opt.StartTime); w.Put<uint8_t>(0); w.Put<uint8_t>(0);
+
+    w.Define(3, 20, { { 253, 4, 0x86 }, { 0, 4, 0x85 }, { 1, 4, 0x85 },
+                      { 2, 2, 0x84 }, { 3, 1, 0x02 }, { 4, 1, 0x02 },
+                      { 5, 4, 0x86 }, { 6, 2, 0x84 }, { 7, 2, 0x84 },
+                      { 13, 1, 0x01 } }, opt.BigEndian, dev);
+    uint32_t t = opt.StartTime;
+    for (int i = 0; i < opt.Records; i++) {
+        w.Begin(3);
+        w.Put<uint32_t>(++t);
+        w.Put<int32_t>(500000000 + i * 100);
+        w.Put<int32_t>(-900000000 - i * 50);
+        w.Put<uint16_t>(i % 7 == 3 ? 0xFFFF : 2500 + i % 100);
+        w.Put<uint8_t>(120 + i % 60);
+        w.Put<uint8_t>(80 + i % 20);
+        w.Put<uint32_t>(i * 300);
+        w.Put<uint16_t>(3000 + i % 500);
+        w.Put<uint16_t>(200 + i % 150);
+        w.Put<int8_t>(20 + i % 5);
+        if (opt.DeveloperFields) {
+            w.Put<uint16_t>(250 + i % 50);
+            w.Put<uint8_t>(60 + i % 10);
+        }
+        for (int k = 0; k < opt.DeveloperArray; k++)
+            w.Put<uint16_t>((i + k) & 0x7FFF);
+    }
+
+    w.Begin(2);
+    w.Put<uint32_t>(t); w.Put<uint8_t>(0); w.Put<uint8_t>(4);
+    return w.Chunk();
+}
+
+/** Return 'chunks' activities of 'opt.Records' records each, chained into
+ * one FIT file. */
+inline Bytes MakeChainedActivity(ActivityOptions opt, int chunks)
+{
+    Bytes data;
+    for (int i = 0; i < chunks; i++) {
+        Bytes c = MakeActivity(opt);
+        data.insert(data.end(), c.begin(), c.end());
+        opt.StartTime += opt.Records + 3600;
+    }
+    return data;
+}
+
+};                                      // end namespace bench
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
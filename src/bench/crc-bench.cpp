@@ -0,0 +1,60 @@
+/** Throughput of the CRC-16 kernels in Crc16.cpp, and of the nibble CRC
+ * they replaced, over one large buffer and over FIT header sized ones.
+ */
+
+#include "Bench.h"
+#include "CrcReference.h"
+#include "../Crc16.h"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+typedef uint16_t (*CrcKernel)(uint16_t, const unsigned char*, size_t);
+
+struct Kernel {
+    const char *Name;
+    CrcKernel Update;
+};
+
+const Kernel kernels[] = {
+    { "nibble (old)", bench::NibbleCrc16Update },
+    { "byte", fit::Crc16UpdateByte },
+    { "slice8", fit::Crc16UpdateSlice8 },
+    { "Crc16Update", fit::Crc16Update },
+};
+
+/** Run 'k' over 'data' in 'block' sized pieces and print its throughput. */
+void Measure(const Kernel &k, const std::vector<unsigned char> &data, size_t block)
+{
+    uint16_t crc = 0;
+    double ms = bench::BestOf(5, [&] {
+            for (size_t pos = 0; pos + block <= data.size(); pos += block)
+                crc ^= k.Update(0, data.data() + pos, block);
+        });
+    std::printf("  %-14s %9.1f MB/s  (%04x)\n",
+                k.Name, data.size() / 1e3 / ms, crc);
+}
+
+};                                      // end anonymous namespace
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<unsigned char> data(16 << 20);
+    for (auto &b : data)
+        b = rng();
+
+    const size_t blocks[] = { data.size(), 64, 14, 12, 8 };
+    for (size_t block : blocks) {
+        if (block == data.size())
+            std::printf("%zu MB buffer:\n", data.size() >> 20);
+        else
+            std::printf("%zu byte blocks:\n", block);
+        for (const auto &k : kernels)
+            Measure(k, data, block);
+    }
+    return 0;
+}
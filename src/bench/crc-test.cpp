@@ -0,0 +1,104 @@
+/** Check that every CRC-16 kernel in Crc16.cpp, and Crc16Update() called on
+ * split buffers, is bit-exact with the nibble CRC from the FIT SDK.  Exits
+ * with a non-zero status on the first mismatch.
+ */
+
+#include "CrcReference.h"
+#include "../Crc16.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+typedef uint16_t (*CrcKernel)(uint16_t, const unsigned char*, size_t);
+
+struct Kernel {
+    const char *Name;
+    CrcKernel Update;
+};
+
+const Kernel kernels[] = {
+    { "Crc16Update", fit::Crc16Update },
+    { "Crc16UpdateByte", fit::Crc16UpdateByte },
+    { "Crc16UpdateSlice8", fit::Crc16UpdateSlice8 },
+};
+
+int g_Failures = 0;
+
+void Fail(const char *what, size_t len, uint16_t got, uint16_t expected)
+{
+    std::fprintf(stderr, "%s: length %zu: got %04x, expected %04x\n",
+                 what, len, got, expected);
+    g_Failures++;
+}
+
+};                                      // end anonymous namespace
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<unsigned char> data(4096 + 2);
+
+    // Lengths around the slicing-by-8 block size and threshold are where
+    // the kernels can go wrong, all of them up to 300 are checked, then
+    // some longer random ones.
+    std::vector<size_t> lengths;
+    for (size_t len = 0; len <= 300; len++)
+        lengths.push_back(len);
+    for (int i = 0; i < 200; i++)
+        lengths.push_back(rng() % 4096);
+
+    for (int pass = 0; pass < 20; pass++) {
+        for (size_t len : lengths) {
+            for (auto &b : data)
+                b = rng();
+            // Start from a non zero CRC too, as an update in the middle of
+            // a file would.
+            uint16_t start = pass == 0 ? 0 : rng();
+            uint16_t expected = bench::NibbleCrc16Update(start, data.data(), len);
+
+            for (const auto &k : kernels) {
+                uint16_t got = k.Update(start, data.data(), len);
+                if (got != expected)
+                    Fail(k.Name, len, got, expected);
+            }
+
+            if (start == 0) {
+                uint16_t got = fit::Crc16(data.data(), len);
+                if (got != expected)
+                    Fail("Crc16", len, got, expected);
+
+                // Data followed by its CRC, low byte first, as in a FIT
+                // file, has a CRC of 0.
+                data[len] = expected & 0xFF;
+                data[len + 1] = expected >> 8;
+                got = fit::Crc16(data.data(), len + 2);
+                if (got != 0)
+                    Fail("Crc16 with trailing CRC", len + 2, got, 0);
+            }
+
+            // Feeding the data in pieces gives the same result as one call.
+            for (int split = 0; split < 4; split++) {
+                uint16_t crc = start;
+                size_t pos = 0;
+                while (pos < len) {
+                    size_t n = std::min<size_t>(len - pos, rng() % 40);
+                    crc = fit::Crc16Update(crc, data.data() + pos, n);
+                    pos += n;
+                }
+                if (crc != expected)
+                    Fail("Crc16Update, split", len, crc, expected);
+            }
+        }
+    }
+
+    if (g_Failures) {
+        std::fprintf(stderr, "crc-test: %d failures\n", g_Failures);
+        return 1;
+    }
+    std::printf("crc-test: all kernels match the nibble CRC\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+/** Value decoding before and after FitDecode.h: the old byte at a time
+ * DecodeAs() against the load and byte swap one, for single values and
+ * arrays in both byte orders, then whole files decoded by ReadFitMessages()
+ * and developer array fields read with Value() and Values().  The old and
+ * new decoders are checked to give the same values.
+ */
+
+#include "Bench.h"
+#include "DecodeReference.h"
+#include "FitWriter.h"
+#include "../FitDecode.h"
+#include "../FitFile.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace {
+
+const int runs = 7;
+
+int g_Failures = 0;
+
+/** The bits of 'v', for checksums which also work for NaN floats. */
+template <typename BT> uint64_t Bits(BT v)
+{
+    uint64_t bits = 0;
+    std::memcpy(&bits, &v, sizeof(v));
+    return bits;
+}
+
+/** Decode all the values of type 'BT' in 'data', at an odd address, as
+ * single values. */
+template <typename BT, typename Decode>
+uint64_t DecodeValues(const bench::Bytes &data, bool revert, Decode decode)
+{
+    uint64_t sum = 0;
+    const unsigned char *p = data.data() + 1;
+    size_t count = (data.size() - 1) / sizeof(BT);
+    for (size_t i = 0; i < count; i++, p += sizeof(BT))
+        sum += Bits(decode(p, revert));
+    return sum;
+}
+
+/** Decode all the values of type 'BT' in 'data' as arrays of 'length'
+ * values. */
+template <typename BT, typename Decode>
+uint64_t DecodeArrays(const bench::Bytes &data, bool revert, int length, Decode decode)
+{
+    uint64_t sum = 0;
+    std::vector<BT> out(length);
+    size_t size = length * sizeof(BT);
+    for (size_t pos = 1; pos + size <= data.size(); pos += size) {
+        decode(data.data() + pos, length, revert, out.data());
+        for (BT v : out)
+            sum += Bits(v);
+    }
+    return sum;
+}
+
+template <typename BT>
+void CompareValues(const char *type, const bench::Bytes &data)
+{
+    for (int revert = 0; revert < 2; revert++) {
+        uint64_t before = 0, after = 0;
+        double before_ms = bench::BestOf(runs, [&] {
+                before = DecodeValues<BT>(data, revert, bench::ByteDecodeAs<BT>);
+            });
+        double after_ms = bench::BestOf(runs, [&] {
+                after = DecodeValues<BT>(data, revert, fit::DecodeAs<BT>);
+            });
+        if (before != after) {
+            std::printf("  MISMATCH for %s values\n", type);
+            g_Failures++;
+        }
+        std::printf("  %-8s %s  values        %7.2f ms  %7.2f ms  %5.2fx\n", type,
+                    revert ? "swapped" : "native ", before_ms, after_ms, before_ms / after_ms);
+    }
+}
+
+template <typename BT>
+void CompareArrays(const char *type, const bench::Bytes &data, int length)
+{
+    for (int revert = 0; revert < 2; revert++) {
+        uint64_t before = 0, after = 0;
+        double before_ms = bench::BestOf(runs, [&] {
+                before = DecodeArrays<BT>(data, revert, length, bench::ByteDecodeArrayAs<BT>);
+            });
+        double after_ms = bench::BestOf(runs, [&] {
+                after = DecodeArrays<BT>(data, revert, length, fit::DecodeArrayAs<BT>);
+            });
+        if (before != after) {
+            std::printf("  MISMATCH for %s arrays\n", type);
+            g_Failures++;
+        }
+        std::printf("  %-8s %s  arrays of %2d  %7.2f ms  %7.2f ms  %5.2fx\n", type,
+                    revert ? "swapped" : "native ", length, before_ms, after_ms,
+                    before_ms / after_ms);
+    }
+}
+
+/** Reads the developer array field of each record, either one element at
+ * a time with Value(), or all of them with Values(). */
+class ArrayReader : public fit::FitBuilder
+{
+public:
+    ArrayReader(bool bulk) : Sum(0), m_Bulk(bulk)
+        {
+            Subscribe(fit::GMN_RECORD);
+            SetNeedsDeveloperFields(true);
+        }
+
+    void OnFitDeveloperValue(int, const fit::FitDeveloperValue &v) override
+        {
+            if (m_Bulk) {
+                double out[256];
+                int n = v.Values(out);
+                for (int i = 0; i < n; ++i)
+                    Sum += out[i];
+            } else {
+                for (int i = 0; i < v.Count(); ++i)
+                    Sum += v.Value(i);
+            }
+        }
+
+    double Sum;
+
+private:
+    bool m_Bulk;
+};
+
+class RecordCount : public fit::FitBuilder
+{
+public:
+    RecordCount() : Records(0) { Subscribe(fit::GMN_RECORD); }
+    void OnFitRecord(const fit::FitRecord &) override { Records++; }
+    int Records;
+};
+
+void DecodeFiles()
+{
+    for (int big_endian = 0; big_endian < 2; big_endian++) {
+        bench::ActivityOptions opt;
+        opt.Records = 200000;
+        opt.BigEndian = big_endian;
+        bench::Bytes data = bench::MakeActivity(opt);
+        RecordCount b;
+        double ms = bench::BestOf(runs, [&] {
+                b = RecordCount();
+                fit::ReadFitMessages(data.data(), data.size(), &b);
+            });
+        std::printf("  %d %s endian records              %7.2f ms\n", b.Records,
+                    big_endian ? "big   " : "little", ms);
+    }
+
+    for (int big_endian = 0; big_endian < 2; big_endian++) {
+        bench::ActivityOptions opt;
+        opt.Records = 60000;
+        opt.BigEndian = big_endian;
+        opt.DeveloperArray = 32;
+        bench::Bytes data = bench::MakeActivity(opt);
+        ArrayReader one(false), all(true);
+        double one_ms = bench::BestOf(runs, [&] {
+                one.Sum = 0;
+                fit::ReadFitMessages(data.data(), data.size(), &one);
+            });
+        double all_ms = bench::BestOf(runs, [&] {
+                all.Sum = 0;
+                fit::ReadFitMessages(data.data(), data.size(), &all);
+            });
+        if (one.Sum != all.Sum) {
+            std::printf("  MISMATCH between Value() and Values()\n");
+            g_Failures++;
+        }
+        std::printf("  %d %s endian records, 32 x uint16 developer array:\n"
+                    "    Value() %7.2f ms, Values() %7.2f ms  %5.2fx\n",
+                    opt.Records, big_endian ? "big" : "little",
+                    one_ms, all_ms, one_ms / all_ms);
+    }
+}
+
+};                                      // end anonymous namespace
+
+int main()
+{
+    std::mt19937 rng(1);
+    bench::Bytes data(4 << 20);
+    for (auto &b : data)
+        b = rng();
+
+    std::printf("%zu MB of values, before (byte at a time) and after:\n", data.size() >> 20);
+    CompareValues<uint16_t>("uint16", data);
+    CompareValues<uint32_t>("uint32", data);
+    CompareValues<uint64_t>("uint64", data);
+    CompareValues<float>("float32", data);
+    CompareArrays<uint16_t>("uint16", data, 32);
+    CompareArrays<uint32_t>("uint32", data, 16);
+    CompareArrays<double>("float64", data, 8);
+
+    std::printf("ReadFitMessages():\n");
+    DecodeFiles();
+    return g_Failures ? 1 : 0;
+}
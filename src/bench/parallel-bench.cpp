@@ -0,0 +1,119 @@
+/** Scaling of the parallel ReadFitMessages() with 1 to 4 threads, compared
+ * to the serial reader, and the effect of the range size chunks are split
+ * into.  The decoded messages are checked against the serial reader.
+ *
+ * Usage: parallel-bench [FILE.fit ...], without files, a synthetic single
+ * chunk activity and a chained one are used.
+ */
+
+#include "Bench.h"
+#include "FitWriter.h"
+#include "../FitFile.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+
+namespace {
+
+/** A typical client: sums a few fields of each record message, so the
+ * result can be compared between readers. */
+class RecordSum : public fit::FitBuilder
+{
+public:
+    RecordSum() : Records(0), Sum(0)
+        {
+            Subscribe(fit::GMN_RECORD);
+            SetNeedsDeveloperFields(true);
+        }
+
+    void OnFitRecord(const fit::FitRecord &r) override
+        {
+            Records++;
+            Sum = Sum * 31 + r.Timestamp.value + r.HeartRate.value + r.Altitude.value;
+        }
+
+    void OnFitDeveloperValue(int, const fit::FitDeveloperValue &v) override
+        {
+            Sum = Sum * 31 + static_cast<uint64_t>(v.Value());
+        }
+
+    uint64_t Records;
+    uint64_t Sum;
+};
+
+const int runs = 7;
+
+int g_Failures = 0;
+
+/** Time the parallel reader with 'threads' threads and 'range_size', and
+ * check that it gives the same result as the serial one. */
+double Measure(const bench::Bytes &data, unsigned threads, size_t range_size,
+               const RecordSum &expected)
+{
+    RecordSum b;
+    double ms = bench::BestOf(runs, [&] {
+            b = RecordSum();
+            fit::ReadFitMessages(data.data(), data.size(), &b, threads, range_size);
+        });
+    if (b.Records != expected.Records || b.Sum != expected.Sum) {
+        std::printf("  MISMATCH with %u threads, range size %zu\n", threads, range_size);
+        g_Failures++;
+    }
+    return ms;
+}
+
+void Run(const std::string &name, const bench::Bytes &data)
+{
+    RecordSum serial;
+    double serial_ms = bench::BestOf(runs, [&] {
+            serial = RecordSum();
+            fit::ReadFitMessages(data.data(), data.size(), &serial);
+        });
+    std::printf("%s: %zu KB, %llu records\n", name.c_str(), data.size() / 1024,
+                static_cast<unsigned long long>(serial.Records));
+    std::printf("  serial        %8.2f ms\n", serial_ms);
+
+    const size_t default_range = 64 * 1024;
+    for (unsigned threads = 1; threads <= 4; threads++) {
+        double ms = Measure(data, threads, default_range, serial);
+        std::printf("  %u thread%s     %8.2f ms  %5.2fx\n", threads,
+                    threads == 1 ? " " : "s", ms, serial_ms / ms);
+    }
+
+    const size_t ranges[] = { 0, 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024 };
+    std::printf("  4 threads, by range size:\n");
+    for (size_t range : ranges) {
+        double ms = Measure(data, 4, range, serial);
+        if (range == 0)
+            std::printf("    no split    %8.2f ms  %5.2fx\n", ms, serial_ms / ms);
+        else
+            std::printf("    %4zu KB     %8.2f ms  %5.2fx\n", range / 1024, ms, serial_ms / ms);
+    }
+}
+
+};                                      // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    std::printf("%u CPU cores\n", std::thread::hardware_concurrency());
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            std::ifstream in(argv[i], std::ios::binary);
+            bench::Bytes data((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+            Run(argv[i], data);
+        }
+    } else {
+        bench::ActivityOptions opt;
+        opt.Records = 200000;
+        opt.DeveloperFields = true;
+        Run("single chunk", bench::MakeActivity(opt));
+        opt.Records = 25000;
+        Run("8 chained chunks", bench::MakeChainedActivity(opt, 8));
+    }
+    return g_Failures ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+/** Check StreamParser against ReadFitMessages(): synthetic files, single
+ * and chained, in both byte orders, are fed in pieces of random sizes and
+ * must give the same callbacks, in the same order.  Data which ends in the
+ * middle of a chunk, or has a bad CRC, must throw.  The parallel reader is
+ * checked against the serial one too, for a range of thread counts and
+ * range sizes.  Exits with a non-zero status if any check fails.
+ */
+
+#include "FitWriter.h"
+#include "../FitFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+/** Writes every callback it receives to 'Log', so the callbacks of two
+ * readers can be compared. */
+class Recorder : public fit::FitBuilder
+{
+public:
+    Recorder()
+        {
+            SetNeedsTimestamps(true);
+            SetNeedsDeveloperFields(true);
+        }
+
+    void OnFitFileId(const fit::FitFileId &m) override
+        {
+            Log << "file_id " << int(m.Type.value) << ' ' << m.Manufacturer.value << ' '
+                << m.Product.value << ' ' << m.SerialNumber.value << ' '
+                << m.TimeCreated.value << '\n';
+        }
+
+    void OnFitRecord(const fit::FitRecord &m) override
+        {
+            Log << "record " << m.Timestamp.value << ' ' << m.PositionLat.value << ' '
+                << m.PositionLong.value << ' ' << m.Altitude.value << ' '
+                << int(m.HeartRate.value) << ' ' << int(m.Cadence.value) << ' '
+                << m.Distance.value << ' ' << m.Speed.value << ' ' << m.Power.value << ' '
+                << int(m.Temperature.value) << ' ' << m.LocalTimestamp.value << '\n';
+        }
+
+    void OnFitDeveloperDataId(const fit::FitDeveloperDataId &m) override
+        {
+            Log << "developer_data_id " << int(m.DeveloperDataIndex.value) << '\n';
+        }
+
+    void OnFitFieldDescription(const fit::FitDeveloperField &m) override
+        {
+            Log << "field_description " << int(m.DeveloperDataIndex.value) << ' '
+                << int(m.FieldNumber.value) << ' ' << int(m.BaseType.value) << ' '
+                << m.Name << '\n';
+        }
+
+    void OnFitDeveloperValue(int global_message, const fit::FitDeveloperValue &v) override
+        {
+            Log << "developer_value " << global_message;
+            for (int i = 0; i < v.Count(); i++)
+                Log << ' ' << v.Value(i);
+            Log << '\n';
+        }
+
+    std::ostringstream Log;
+};
+
+struct TestFile {
+    std::string Name;
+    bench::Bytes Data;
+    /** Size of the first FIT chunk, the data is truncated inside it. */
+    size_t FirstChunk;
+    /** Only checked with the parallel reader, which needs a large chunk
+     * to split it, streaming it in small pieces would take long. */
+    bool ParallelOnly;
+};
+
+int g_Failures = 0;
+
+void Fail(const std::string &file, const std::string &what)
+{
+    std::fprintf(stderr, "%s: %s\n", file.c_str(), what.c_str());
+    g_Failures++;
+}
+
+std::string ReadAll(const bench::Bytes &data)
+{
+    Recorder r;
+    fit::ReadFitMessages(data.data(), data.size(), &r);
+    return r.Log.str();
+}
+
+/** Feed 'data' to a StreamParser in pieces of 1 to 'max_piece' bytes. */
+std::string StreamAll(const bench::Bytes &data, size_t max_piece, std::mt19937 &rng)
+{
+    Recorder r;
+    fit::StreamParser parser(&r);
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t n = std::min<size_t>(data.size() - pos, 1 + rng() % max_piece);
+        parser.Feed(data.data() + pos, n);
+        pos += n;
+    }
+    parser.Finish();
+    return r.Log.str();
+}
+
+/** Return true if streaming 'data' throws an exception. */
+bool StreamThrows(const bench::Bytes &data, std::mt19937 &rng)
+{
+    try {
+        StreamAll(data, 1000, rng);
+    }
+    catch (std::exception &) {
+        return true;
+    }
+    return false;
+}
+
+void CheckSplits(const TestFile &f, const std::string &expected, std::mt19937 &rng)
+{
+    const size_t max_pieces[] = { 1, 2, 7, 13, 64, 500, 4096, 100000 };
+    for (size_t max_piece : max_pieces) {
+        int runs = max_piece == 1 ? 1 : 20;
+        for (int i = 0; i < runs; i++) {
+            try {
+                if (StreamAll(f.Data, max_piece, rng) != expected) {
+                    Fail(f.Name, "different callbacks with pieces of up to "
+                         + std::to_string(max_piece) + " bytes");
+                    return;
+                }
+            }
+            catch (std::exception &e) {
+                Fail(f.Name, std::string("exception: ") + e.what());
+                return;
+            }
+        }
+    }
+}
+
+void CheckReset(const TestFile &f, const std::string &expected, std::mt19937 &rng)
+{
+    // A parser which is reset part way through a file parses the next one
+    // from scratch.
+    Recorder r;
+    fit::StreamParser parser(&r);
+    parser.Feed(f.Data.data(), f.FirstChunk / 2);
+    parser.Reset();
+    r.Log.str("");
+    size_t pos = 0;
+    while (pos < f.Data.size()) {
+        size_t n = std::min<size_t>(f.Data.size() - pos, 1 + rng() % 300);
+        parser.Feed(f.Data.data() + pos, n);
+        pos += n;
+    }
+    parser.Finish();
+    if (r.Log.str() != expected)
+        Fail(f.Name, "different callbacks after Reset()");
+}
+
+void CheckErrors(const TestFile &f, std::mt19937 &rng)
+{
+    // Truncated in the header, in the messages and in the CRC
+    std::vector<size_t> cuts = { 1, 13, 14, 15, f.FirstChunk - 2, f.FirstChunk - 1 };
+    for (int i = 0; i < 20; i++)
+        cuts.push_back(15 + rng() % (f.FirstChunk - 16));
+    for (size_t cut : cuts) {
+        bench::Bytes data(f.Data.begin(), f.Data.begin() + cut);
+        if (! StreamThrows(data, rng))
+            Fail(f.Name, "no exception when truncated to " + std::to_string(cut) + " bytes");
+    }
+
+    // A bad chunk CRC, then a bad byte in the messages
+    bench::Bytes data = f.Data;
+    data[f.FirstChunk - 1] ^= 0x5A;
+    if (! StreamThrows(data, rng))
+        Fail(f.Name, "no exception for a bad CRC");
+    for (int i = 0; i < 10; i++) {
+        data = f.Data;
+        data[14 + rng() % (f.FirstChunk - 16)] ^= 1 << (rng() % 8);
+        if (! StreamThrows(data, rng))
+            Fail(f.Name, "no exception for a changed byte");
+    }
+}
+
+void CheckParallel(const TestFile &f, const std::string &expected)
+{
+    const size_t ranges[] = { 0, 16 * 1024, 64 * 1024 };
+    for (unsigned threads = 1; threads <= 4; threads++) {
+        for (size_t range : ranges) {
+            Recorder r;
+            fit::ReadFitMessages(f.Data.data(), f.Data.size(), &r, threads, range);
+            if (r.Log.str() != expected) {
+                Fail(f.Name, "parallel reader differs with " + std::to_string(threads)
+                     + " threads, range size " + std::to_string(range));
+            }
+        }
+    }
+}
+
+std::vector<TestFile> MakeFiles()
+{
+    std::vector<TestFile> files;
+    for (int big_endian = 0; big_endian < 2; big_endian++) {
+        std::string order = big_endian ? ", big endian" : ", little endian";
+        bench::ActivityOptions opt;
+        opt.BigEndian = big_endian;
+        opt.Records = 1000;
+        bench::Bytes data = bench::MakeActivity(opt);
+        files.push_back({ "activity" + order, data, data.size(), false });
+
+        opt.DeveloperFields = true;
+        opt.DeveloperArray = 5;
+        data = bench::MakeActivity(opt);
+        files.push_back({ "developer fields" + order, data, data.size(), false });
+
+        opt.Records = 20000;
+        data = bench::MakeActivity(opt);
+        files.push_back({ "large activity" + order, data, data.size(), true });
+
+        opt.Records = 500;
+        size_t first = bench::MakeActivity(opt).size();
+        files.push_back({ "4 chained chunks" + order, bench::MakeChainedActivity(opt, 4), first, false });
+    }
+    return files;
+}
+
+};                                      // end anonymous namespace
+
+int main()
+{
+    std::mt19937 rng(1);
+    for (const auto &f : MakeFiles()) {
+        std::string expected = ReadAll(f.Data);
+        if (expected.empty()) {
+            Fail(f.Name, "no callbacks from ReadFitMessages()");
+            continue;
+        }
+        CheckParallel(f, expected);
+        if (f.ParallelOnly)
+            continue;
+        CheckSplits(f, expected, rng);
+        CheckReset(f, expected, rng);
+        CheckErrors(f, rng);
+    }
+
+    if (g_Failures) {
+        std::fprintf(stderr, "stream-test: %d failures\n", g_Failures);
+        return 1;
+    }
+    std::printf("stream-test: StreamParser and the parallel reader match ReadFitMessages()\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+#
+# Generate FitProfile.h, which contains constexpr tables describing the FIT
+# messages and fields listed in fit-profile.txt.  See that file for the input
+# format.  Run by the Makefile, the output goes to stdout.
+
+import sys, argparse;
+
+base_types = {
+    'enum' : 0x00, 'sint8' : 0x01, 'uint8' : 0x02, 'sint16' : 0x83,
+    'uint16' : 0x84, 'sint32' : 0x85, 'uint32' : 0x86, 'string' : 0x07,
+    'float32' : 0x88, 'float64' : 0x89, 'uint8z' : 0x0A, 'uint16z' : 0x8B,
+    'uint32z' : 0x8C, 'byte' : 0x0D };
+
+def fail(file_name, line_no, message):
+    sys.stderr.write('%s:%d: %s\n' % (file_name, line_no, message));
+    sys.exit(1);
+
+def read_profile(file_name):
+    messages = [];
+    with open(file_name) as f:
+        for line_no, line in enumerate(f, 1):
+            words = line.split('#', 1)[0].split();
+            if not words:
+                continue;
+            if words[0] == 'message' and len(words) == 3:
+                messages.append({ 'name' : words[1], 'number' : int(words[2]), 'fields' : [] });
+            elif words[0] == 'field' and 4 <= len(words) <= 7:
+                if not messages:
+                    fail(file_name, line_no, 'field outside a message');
+                if words[3] not in base_types:
+                    fail(file_name, line_no, 'unknown base type ' + words[3]);
+                messages[-1]['fields'].append({
+                    'name' : words[1],
+                    'number' : int(words[2]),
+                    'type' : base_types[words[3]],
+                    'scale' : float(words[4]) if len(words) > 4 else 1.0,
+                    'offset' : float(words[5]) if len(words) > 5 else 0.0,
+                    'units' : words[6] if len(words) > 6 else '' });
+            else:
+                fail(file_name, line_no, 'cannot parse: ' + line.strip());
+    return messages;
+
+def write_header(messages, source, out):
+    out.write('// Generated by fit-profile-gen.py from %s, do not edit.\n' % source);
+    out.write('''#pragma once
+#include <stdint.h>
+
+namespace fit {
+namespace profile {
+
+/** Description of a single field in the FIT profile. */
+struct FieldInfo
+{
+    uint8_t Number;
+    uint8_t BaseType;
+    double Scale;
+    double Offset;
+    const char *Name;
+    const char *Units;
+};
+
+/** Properties of field number F of global message M, see the
+ * specializations below. */
+template <int M, int F> struct Field;
+
+/** Properties of global message M, see the specializations below. */
+template <int M> struct Message;
+
+/** Convert a raw value of field F in message M to physical units.  This
+ * resolves at compile time, and the conversion is inlined. */
+template <int M, int F, typename T>
+constexpr double ToPhysical(T raw)
+{
+    return raw / Field<M, F>::Scale - Field<M, F>::Offset;
+}
+
+''');
+    for m in messages:
+        out.write('\n// %s (%d)\n\n' % (m['name'], m['number']));
+        out.write('namespace %s {\n' % m['name']);
+        out.write('enum { MESSAGE = %d };\n' % m['number']);
+        out.write('enum FieldNumber {\n');
+        out.write(',\n'.join('    %s = %d' % (f['name'], f['number']) for f in m['fields']));
+        out.write('\n};\n');
+        out.write('};\n\n');
+        for f in m['fields']:
+            out.write('template <> struct Field<%d, %d> {\n' % (m['number'], f['number']));
+            out.write('    static constexpr uint8_t BaseType = 0x%02X;\n' % f['type']);
+            out.write('    static constexpr double Scale = %r;\n' % f['scale']);
+            out.write('    static constexpr double Offset = %r;\n' % f['offset']);
+            out.write('    static constexpr const char *Name = "%s";\n' % f['name']);
+            out.write('    static constexpr const char *Units = "%s";\n' % f['units']);
+            out.write('};\n\n');
+        out.write('template <> struct Message<%d> {\n' % m['number']);
+        out.write('    static constexpr const char *Name = "%s";\n' % m['name']);
+        out.write('    static constexpr int NumFields = %d;\n' % len(m['fields']));
+        out.write('    static constexpr FieldInfo Fields[NumFields] = {\n');
+        out.write(',\n'.join('        { %d, 0x%02X, %r, %r, "%s", "%s" }'
+                             % (f['number'], f['type'], f['scale'], f['offset'], f['name'], f['units'])
+                             for f in m['fields']));
+        out.write('\n    };\n');
+        out.write('''    /** Return true if 'field' is a field of this message we decode. */
+    static constexpr bool HasField(int field) {
+        for (int i = 0; i < NumFields; i++)
+            if (Fields[i].Number == field)
+                return true;
+        return false;
+    }
+};
+''');
+    out.write('\n};                                      // end namespace profile\n');
+    out.write('};                                      // end namespace fit\n');
+
+if __name__ == '__main__':
+    opt_parser = argparse.ArgumentParser(
+        description = "Generate FitProfile.h from a FIT profile description.");
+    opt_parser.add_argument('profile', help = 'profile description file');
+    args = opt_parser.parse_args();
+    write_header(read_profile(args.profile), args.profile, sys.stdout);
@@ -1,14 +1,32 @@
 #include "LinuxUtil.h"
 #include "Storage.h"
 #include "FitFile.h"
+#include "SyncManifest.h"
+#include "WorkQueue.h"
+#include "FileCatalog.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <strings.h>
-#include <utime.h>
-#include <queue>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include <sstream>
@@ -27,47 +45,83 @@ const char *g_PidFile = "/run/fit-sync/fit-sync-usb.pid";
 
 bool g_DaemonMode = false;
 
-namespace {
+// path of the directory being scanned, entry names are appended to it while
+// they are processed, so paths are built without allocating memory.
+std::string g_Path;
 
-struct FoundFitFileId {};
+// when true, all FIT files are copied, by default only Activity FIT file
+// types are copied.
+bool g_AllFiles = false;
 
-class MyBuilder : public fit::FitBuilder
-{
-public:
+// when true, the CRC of FIT files is checked before they are copied.  By
+// default, only the start of the file is read to determine its type.
+bool g_VerifyCrc = false;
 
-    MyBuilder(fit::FitFileId &fid) : m_fid(fid)
-        {
-        }
+// when true, a timestamp index (see fit::BuildFitIndex) is written next to
+// each copied file, with an ".idx" extension.
+bool g_WriteIndex = false;
 
-    void OnFitFileId(const fit::FitFileId &m) override
-        {
-            m_fid = m;
-            throw FoundFitFileId ();
-        }
+// time between entries in the timestamp index, in seconds
+const uint32_t index_bucket = 60;
 
-private:
-    fit::FitFileId &m_fid;
-};
+// when true, the sync manifest is ignored and all files are processed
+// again; the manifest is then rebuilt.
+bool g_Rescan = false;
 
+// files which were processed by an earlier run and have not changed since,
+// are skipped using this manifest (see SyncManifest).
+SyncManifest *g_Manifest = nullptr;
 
-void GetFitFileId(Buffer &buf, fit::FitFileId &fid)
-{
-    MyBuilder b(fid);
-    try {
-        ReadFitMessages(buf, &b);
-    }
-    catch (const FoundFitFileId &) {
-        // found it
-    }
-}
+// the directory being synced, the manifest keys files by their path relative
+// to it.
+std::string g_SourceDir;
 
-};                                      // end anonymous namespace
+// number of files skipped because the manifest has them as unchanged
+int g_UnchangedFiles = 0;
 
-std::queue<std::string> g_DelayedDirs;
+// the manifest is saved after this many files are processed, so little work
+// is repeated after a crash.
+const int manifest_save_interval = 32;
 
-// when true, all FIT files are copied, by default only Activity FIT file
-// types are copied.
-bool g_AllFiles = false;
+// number of worker threads for the probe, read and write stages, set with
+// --jobs.
+int g_ProbeJobs = 1;
+int g_ReadJobs = 1;
+int g_WriteJobs = 1;
+
+// when true, the time spent in each stage is printed at the end.
+bool g_Timing = false;
+
+// number of files written before they are flushed to disk together, and
+// the longest time a written file waits for the flush, in milliseconds; set
+// with --sync-batch and --sync-delay.
+int g_SyncBatch = 32;
+int g_SyncDelay = 2000;
+
+// maximum number of files waiting between two stages; this bounds the
+// memory used by files which were read and are waiting to be written.
+const size_t queue_capacity = 8;
+
+std::mutex g_LogMutex;
+std::mutex g_ManifestMutex;
+
+void LogMessage(int priority, const std::string &msg)
+{
+    std::lock_guard<std::mutex> lock(g_LogMutex);
+    if (g_DaemonMode)
+        syslog(priority, "%s", msg.c_str());
+    else if (priority <= LOG_WARNING)
+        std::cerr << msg << "\n";
+    else
+        std::cout << msg << "\n";
+}
+
+void LogFileError(const std::string &path, const std::exception &e)
+{
+    std::ostringstream msg;
+    msg << path << ": " << e.what();
+    LogMessage(LOG_ERR, msg.str());
+}
 
 std::string BaseName(const std::string &path)
 {
@@ -79,85 +133,658 @@ std::string BaseName(const std::string &path)
 }
 
 
-void ProcessFitFile(const std::string &path)
+// ........................................................ Sync stages ....
+
+/** Files are synced by a pipeline of stages, connected by work queues:
+ *
+ *  - scan: the directory walk, on the main thread, which skips the files
+ *    the manifest has as unchanged,
+ *  - probe: reads the file ID message, at the start of the file, to
+ *    decide whether the file is copied,
+ *  - read: reads the contents of the file from the device, only when an
+ *    index is written, since the index needs the file contents,
+ *  - write: writes the file and its index to the storage directory.
+ *
+ * Each stage after the scan runs on its own worker threads (see --jobs), so
+ * reading from a slow device overlaps with writing and indexing the files
+ * read before.  Without an index, the file is copied by the kernel in the
+ * write stage, and its contents are never read into memory.
+ */
+struct SyncJob
 {
-    try {
-        Buffer fit_file;
-        ReadData(path, fit_file);
-        fit::FitFileId fid;
-        GetFitFileId(fit_file, fid);
-        auto file_type = static_cast<AntfsFileSubType>(fid.Type.value);
-        if (g_AllFiles || file_type == FST_ACTIVITY)
-        {
-            auto p = GetFileStoragePath(
-                fid.SerialNumber,
-                file_type);
-            std::ostringstream target;
-            target << p << "/" << BaseName(path);
-            WriteData(target.str(), fit_file);
-
-            // Set the file access and modification times to the FIT creation
-            // time, to make them easier to identify.
-            struct utimbuf tb;
-            tb.actime = tb.modtime = fid.TimeCreated;
-            utime(target.str().c_str(), &tb);
-
-            if (g_DaemonMode)
-                syslog(LOG_INFO, "%s went into %s", path.c_str(), target.str().c_str());
-            else
-                std::cout << path << " went into " << target.str() << "\n";
+    /** Path of the file, and the same path relative to g_SourceDir, which
+     * is the manifest key. */
+    std::string Path;
+    std::string Key;
+    struct stat Stat;
+    /** The manifest has the file, with a different size or modification
+     * time. */
+    bool Changed;
+    fit::FitFileId FileId;
+    /** Where the file is copied: the storage directory, open as TargetDir,
+     * and the file name in it; Target is the full path, for messages. */
+    int TargetDir;
+    std::string TargetName;
+    std::string Target;
+    /** The target path relative to the base storage directory, and the
+     * content hash, if the contents were read, for the file catalog. */
+    std::string CatalogPath;
+    uint64_t Hash;
+    /** The contents of the file, read by the read stage, of any size. */
+    std::unique_ptr<MappedFile> Contents;
+};
+
+typedef std::unique_ptr<SyncJob> SyncJobPtr;
+
+typedef WorkQueue<SyncJobPtr> SyncQueue;
+
+SyncQueue g_ProbeQueue(queue_capacity);
+SyncQueue g_ReadQueue(queue_capacity);
+SyncQueue g_WriteQueue(queue_capacity);
+
+/** Work done by a stage, the time is summed over its workers and does not
+ * include waiting on the queues, except for the scan, which can wait for
+ * room in the probe queue. */
+struct StageTiming
+{
+    StageTiming(const char *name) : Name(name), Files(0), Bytes(0), Nanoseconds(0) {}
+
+    void Report(int workers) const;
+
+    const char *Name;
+    std::atomic<uint64_t> Files;
+    std::atomic<uint64_t> Bytes;
+    std::atomic<uint64_t> Nanoseconds;
+};
+
+StageTiming g_ScanTiming("scan");
+StageTiming g_ProbeTiming("probe");
+StageTiming g_ReadTiming("read");
+StageTiming g_WriteTiming("write");
+
+void StageTiming::Report(int workers) const
+{
+    double ms = Nanoseconds / 1e6;
+    std::ostringstream msg;
+    msg << Name << ": " << Files << " files";
+    if (Bytes > 0)
+        msg << ", " << Bytes / 1024 << " KiB";
+    msg << ", " << workers << (workers == 1 ? " worker, " : " workers, ")
+        << ms << " ms";
+    if (Bytes > 0 && ms > 0)
+        msg << ", " << (Bytes / 1048576.0) / (ms / 1000) << " MiB/s";
+    LogMessage(LOG_INFO, msg.str());
+}
+
+/** Adds the time from its construction to its destruction to a stage. */
+class StageTimer
+{
+public:
+    StageTimer(StageTiming &timing)
+        : m_Timing(timing), m_Start(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        auto d = std::chrono::steady_clock::now() - m_Start;
+        m_Timing.Nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    }
+
+private:
+    StageTiming &m_Timing;
+    std::chrono::steady_clock::time_point m_Start;
+};
+
+/** Record a processed file in the manifest, which is saved every
+ * manifest_save_interval files. */
+void RecordFile(const SyncJob &job, bool copied)
+{
+    std::lock_guard<std::mutex> lock(g_ManifestMutex);
+    if (g_Manifest && ! job.Key.empty()) {
+        g_Manifest->Record(job.Key, job.Stat, job.FileId.SerialNumber, copied);
+        if (g_Manifest->Pending() >= manifest_save_interval)
+            g_Manifest->Save(false);
+    }
+}
+
+/** Called by the scan for each FIT file found.  Only files in g_SourceDir
+ * are in the manifest, not the ones from other watched directories. */
+void QueueFitFile(const std::string &path, const struct stat &st)
+{
+    std::string key;
+    if (path.compare(0, g_SourceDir.size() + 1, g_SourceDir + "/") == 0)
+        key = path.substr(g_SourceDir.size() + 1);
+    bool changed = false;
+    {
+        // Files skipped by an earlier run because of their type need to be
+        // looked at again when all files are copied.
+        std::lock_guard<std::mutex> lock(g_ManifestMutex);
+        if (g_Manifest && ! key.empty() && g_Manifest->IsUnchanged(key, st, g_AllFiles)) {
+            g_UnchangedFiles++;
+            return;
         }
+        changed = g_Manifest && ! key.empty() && g_Manifest->Contains(key);
+    }
+    g_ScanTiming.Files++;
+    SyncJobPtr job(new SyncJob);
+    job->Hash = 0;
+    job->Path = path;
+    job->Key = key;
+    job->Stat = st;
+    job->Changed = changed;
+    g_ProbeQueue.Push(std::move(job));
+}
+
+void ProbeStage()
+{
+    SyncJobPtr job;
+    while (g_ProbeQueue.Pop(job)) {
+        try {
+            StageTimer timer(g_ProbeTiming);
+            g_ProbeTiming.Files++;
+            fit::ProbeFileId(job->Path, job->FileId, nullptr, g_VerifyCrc);
+            auto file_type = static_cast<AntfsFileSubType>(job->FileId.Type.value);
+            if (! g_AllFiles && file_type != FST_ACTIVITY) {
+                RecordFile(*job, false);
+                continue;
+            }
+
+            std::string base = GetBaseStoragePath();
+            job->TargetName = BaseName(job->Path);
+            job->Target = GetFileStoragePath(job->FileId.SerialNumber, file_type)
+                + "/" + job->TargetName;
+            job->CatalogPath = job->Target.substr(base.size() + 1);
+
+            // A file which is already stored, received by fit-sync-ant or
+            // from another directory, is not stored again, when the stored
+            // file has the same contents.  A file which the manifest saw
+            // change always replaces its own stored copy.  A rescan
+            // processes all files.
+            FileCatalog::Entry stored;
+            if (! g_Rescan
+                && GetFileCatalog().Find(job->FileId.SerialNumber, file_type,
+                                         job->FileId.TimeCreated, stored)
+                && stored.Size == static_cast<uint64_t>(job->Stat.st_size)
+                && ! (job->Changed && stored.Path == job->CatalogPath)
+                && SameFileContents(job->Path, base + "/" + stored.Path)) {
+                LogMessage(LOG_INFO, job->Path + " already stored as " + stored.Path);
+                RecordFile(*job, true);
+                continue;
+            }
+
+            job->TargetDir = GetFileStorageDir(job->FileId.SerialNumber, file_type);
+        }
+        catch (const std::exception &e) {
+            LogFileError(job->Path, e);
+            continue;
+        }
+        if (g_WriteIndex)
+            g_ReadQueue.Push(std::move(job));
+        else
+            g_WriteQueue.Push(std::move(job));
+    }
+}
+
+void ReadStage()
+{
+    SyncJobPtr job;
+    while (g_ReadQueue.Pop(job)) {
+        try {
+            StageTimer timer(g_ReadTiming);
+            job->Contents.reset(new MappedFile(job->Path));
+            job->Contents->Load();
+            g_ReadTiming.Files++;
+            g_ReadTiming.Bytes += job->Contents->Size();
+        }
+        catch (const std::exception &e) {
+            LogFileError(job->Path, e);
+            continue;
+        }
+        g_WriteQueue.Push(std::move(job));
+    }
+}
+
+/** Commit the files written for 'jobs' and record them in the manifest.
+ * Files are only recorded once they are safely on disk, so a file lost in
+ * a power cut is copied again on the next run. */
+void CommitJobs(WriteBatch &batch, std::vector<SyncJobPtr> &jobs)
+{
+    try {
+        StageTimer timer(g_WriteTiming);
+        batch.Commit();
     }
     catch (const std::exception &e) {
-        std::ostringstream msg;
-        msg << path << ": " << e.what();
-        if (g_DaemonMode)
-            syslog(LOG_ERR, "%s", msg.str().c_str());
+        for (const auto &job : jobs)
+            LogFileError(job->Path, e);
+        jobs.clear();
+        return;
+    }
+    for (const auto &job : jobs) {
+        LogMessage(LOG_INFO, job->Path + " went into " + job->Target);
+        FileCatalog::Entry e;
+        e.Hash = job->Hash;
+        e.SerialNumber = job->FileId.SerialNumber;
+        e.TimeCreated = job->FileId.TimeCreated;
+        e.Type = job->FileId.Type.value;
+        e.Size = job->Stat.st_size;
+        e.Path = job->CatalogPath;
+        GetFileCatalog().Add(e);
+        RecordFile(*job, true);
+    }
+    jobs.clear();
+}
+
+void WriteStage()
+{
+    // decoder state for all the files indexed by this worker, so its
+    // storage is only allocated once.
+    fit::ParseContext parse_context;
+
+    WriteBatch batch(g_SyncBatch, std::chrono::milliseconds(g_SyncDelay));
+    std::vector<SyncJobPtr> written;
+
+    for (;;) {
+        // While files are waiting to be committed, wait for more work only
+        // until they are due.
+        SyncJobPtr job;
+        SyncQueue::PopResult status;
+        if (! written.empty())
+            status = g_WriteQueue.PopFor(job, batch.TimeLeft());
+        else if (g_WriteQueue.Pop(job))
+            status = SyncQueue::PopResult::Item;
         else
-            std::cerr << msg.str() << "\n";
+            status = SyncQueue::PopResult::Closed;
+        if (status == SyncQueue::PopResult::Closed)
+            break;
+
+        if (status == SyncQueue::PopResult::Item) {
+            try {
+                StageTimer timer(g_WriteTiming);
+                // The file access and modification times are set to the FIT
+                // creation time, to make them easier to identify.
+                time_t created = job->FileId.TimeCreated;
+                size_t size = 0;
+                const unsigned char *data = g_WriteIndex ? job->Contents->Data() : nullptr;
+                if (g_WriteIndex) {
+                    size = job->Contents->Size();
+                    batch.WriteData(job->TargetDir, job->TargetName, data, size, created);
+                    job->Hash = FileCatalog::ContentHash(data, size);
+                } else {
+                    size = batch.CopyFile(job->Path, job->TargetDir, job->TargetName, created);
+                }
+                g_WriteTiming.Files++;
+                g_WriteTiming.Bytes += size;
+
+                // The index is written last, a file which cannot be indexed
+                // is still copied.
+                fit::FitIndex index;
+                if (g_WriteIndex
+                    && fit::BuildFitIndex(data, size, index_bucket, index, parse_context)) {
+                    std::ostringstream idx;
+                    fit::WriteFitIndex(idx, index);
+                    std::string data = idx.str();
+                    batch.WriteData(job->TargetDir, job->TargetName + ".idx",
+                                    reinterpret_cast<const unsigned char*>(data.data()), data.size());
+                }
+
+                // The data is no longer needed, don't hold on to it until
+                // the commit.
+                job->Contents.reset();
+                written.push_back(std::move(job));
+            }
+            catch (const std::exception &e) {
+                LogFileError(job->Path, e);
+            }
+        }
+
+        if (batch.Full() || batch.TimeLeft() <= std::chrono::steady_clock::duration::zero())
+            CommitJobs(batch, written);
     }
+    CommitJobs(batch, written);
 }
 
-void ScanDir(const std::string &dir)
+/** Parse the --jobs argument: either one number of workers for all the
+ * stages, or PROBE,READ,WRITE. */
+bool ParseJobs(const char *arg)
 {
-    DIR *d = opendir(dir.c_str());
+    int probe = 0, read = 0, write = 0;
+    char extra = 0;
+    int n = sscanf(arg, "%d,%d,%d%c", &probe, &read, &write, &extra);
+    if (n == 1 && strspn(arg, "0123456789") == strlen(arg))
+        read = write = probe;
+    else if (n != 3)
+        return false;
+    const int max_jobs = 64;
+    if (probe < 1 || read < 1 || write < 1
+        || probe > max_jobs || read > max_jobs || write > max_jobs)
+        return false;
+    g_ProbeJobs = probe;
+    g_ReadJobs = read;
+    g_WriteJobs = write;
+    return true;
+}
+
+void AddWatch(const std::string &path);
+
+bool IsFitFileName(const char *name)
+{
+    const char *p = strrchr(name, '.');
+    return p && strcasecmp(p, ".fit") == 0;
+}
+
+/** Closes a directory stream when the scan of a directory ends. */
+struct DirCloser
+{
+    DirCloser(DIR *d) : m_Dir(d) {}
+    ~DirCloser() { closedir(m_Dir); }
+    DIR *m_Dir;
+};
+
+/** Process the FIT files in the directory open as 'dir_fd', whose path is
+ * in g_Path, then its sub-directories.  The directory is closed when done.
+ *
+ * Over MTP, every stat() is a round trip to the device, so the entry type
+ * from readdir() is used when the file system provides it, and only FIT
+ * files are stat()-ed, for their size and modification time.  Entries are
+ * looked up relative to their directory, which saves resolving the full
+ * path each time.
+ */
+void ScanDir(int dir_fd)
+{
+    DIR *d = fdopendir(dir_fd);
     if (! d) {
-        throw UnixException("opendir", errno);
+        int e = errno;
+        close(dir_fd);
+        throw UnixException("fdopendir", e);
     }
+    DirCloser closer(d);
+    AddWatch(g_Path);
+
+    size_t dir_length = g_Path.size();
+    std::vector<std::string> subdirs;
     while (struct dirent *e = readdir(d)) {
-        std::ostringstream path;
-        path << dir << "/" << e->d_name;
+        if (! strcmp(e->d_name, ".") || ! strcmp(e->d_name, ".."))
+            continue;
+        bool fit_file = IsFitFileName(e->d_name);
+        if (e->d_type == DT_DIR) {
+            subdirs.push_back(e->d_name);
+            continue;
+        }
+        // Symbolic links are followed, and need a stat() like entries of
+        // unknown type.
+        if (e->d_type != DT_UNKNOWN && e->d_type != DT_LNK
+            && (e->d_type != DT_REG || ! fit_file))
+            continue;
+
+        g_Path.resize(dir_length);
+        g_Path += '/';
+        g_Path += e->d_name;
         struct stat buf;
-        int r = stat(path.str().c_str(), &buf);
+        int r = fstatat(dir_fd, e->d_name, &buf, 0);
         if (r != 0) {
             auto ex = UnixException("stat", errno);
             std::ostringstream msg;
-            msg << path.str() << ", " << ex.what();
-            if (g_DaemonMode)
-                syslog(LOG_ERR, "%s", msg.str().c_str());
-            else
-                std::cerr << msg.str() << "\n";
+            msg << g_Path << ", " << ex.what();
+            LogMessage(LOG_ERR, msg.str());
+            continue;
+        }
+        if (S_ISDIR(buf.st_mode))
+            subdirs.push_back(e->d_name);
+        else if (S_ISREG(buf.st_mode) && fit_file)
+            QueueFitFile(g_Path, buf);
+    }
+
+    for (const auto &name : subdirs) {
+        g_Path.resize(dir_length);
+        g_Path += '/';
+        g_Path += name;
+        int fd = openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            throw UnixException("openat " + g_Path, errno);
+        }
+        ScanDir(fd);
+    }
+    g_Path.resize(dir_length);
+}
+
+
+// ............................................................ Watching ....
+
+/** In watch mode (--watch), the process stays resident after the first scan
+ * and syncs FIT files as they are written into the synced directory or into
+ * ~/Dropbox, using inotify.  Events come in bursts, so the files are
+ * collected until there are no new events for watch_quiet_time, but for no
+ * longer than watch_max_delay, and then passed on to the sync stages.  When
+ * a file system is mounted on the synced directory, it is scanned again.
+ *
+ * Note that inotify only reports changes made through this machine: a FUSE
+ * file system such as jmtpfs does not report files created on the device
+ * itself, those are found by the scan when the device is mounted.
+ */
+bool g_WatchMode = false;
+
+// inotify instance, -1 when not watching
+int g_Inotify = -1;
+
+// watched directories, by watch descriptor
+std::unordered_map<int, std::string> g_Watches;
+
+const std::chrono::milliseconds watch_quiet_time(200);
+const std::chrono::milliseconds watch_max_delay(500);
+
+// in watch mode, the write stage flushes files after this many
+// milliseconds, unless --sync-delay is used, so they appear quickly.
+const int watch_sync_delay = 250;
+
+/** Watch the directory 'path', called by ScanDir() for each directory. */
+void AddWatch(const std::string &path)
+{
+    if (g_Inotify == -1)
+        return;
+    int wd = inotify_add_watch(g_Inotify, path.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd == -1) {
+        auto ex = UnixException("inotify_add_watch", errno);
+        LogMessage(LOG_WARNING, path + ", " + ex.what());
+        return;
+    }
+    g_Watches[wd] = path;
+}
+
+/** Scan the directory 'path', and its sub-directories, adding watches for
+ * them.  Returns false if the directory could not be scanned. */
+bool ScanPath(const std::string &path)
+{
+    try {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            throw UnixException("open " + path, errno);
+        }
+        StageTimer timer(g_ScanTiming);
+        g_Path = path;
+        ScanDir(fd);
+        return true;
+    }
+    catch (std::exception &e) {
+        LogMessage(LOG_ERR, e.what());
+        return false;
+    }
+}
+
+/** Read the pending inotify events, adding FIT files which were written to
+ * 'files' and new directories to 'dirs'.  When events were lost, the
+ * watched 'roots' are added to 'dirs', to be scanned again. */
+void ReadWatchEvents(std::set<std::string> &files, std::set<std::string> &dirs,
+                     const std::vector<std::string> &roots)
+{
+    alignas(struct inotify_event) char buf[16 * 1024];
+    for (;;) {
+        ssize_t n = read(g_Inotify, buf, sizeof(buf));
+        if (n <= 0)
+            return;
+        for (ssize_t pos = 0; pos < n; ) {
+            const auto *ev = reinterpret_cast<const struct inotify_event*>(buf + pos);
+            pos += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                LogMessage(LOG_WARNING, "inotify queue overflow, scanning again");
+                dirs.insert(roots.begin(), roots.end());
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                // the directory was removed or unmounted
+                g_Watches.erase(ev->wd);
+                continue;
+            }
+            auto w = g_Watches.find(ev->wd);
+            if (w == g_Watches.end() || ev->len == 0)
+                continue;
+            std::string path = w->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                    dirs.insert(path);
+            }
+            else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && IsFitFileName(ev->name)) {
+                files.insert(path);
+            }
+        }
+    }
+}
+
+/** Pass the files and directories collected from the watch events on to
+ * the sync stages. */
+void ProcessWatchEvents(std::set<std::string> &files, std::set<std::string> &dirs)
+{
+    for (const auto &path : dirs)
+        ScanPath(path);
+    for (const auto &path : files) {
+        // Files in the directories just scanned were queued by the scan
+        bool scanned = false;
+        for (const auto &dir : dirs)
+            scanned = scanned || path.compare(0, dir.size() + 1, dir + "/") == 0;
+        if (scanned)
             continue;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            QueueFitFile(path, st);
+    }
+    files.clear();
+    dirs.clear();
+}
+
+/** Return the device of the file system holding 'path', or 0 if 'path'
+ * cannot be accessed, for example while the device is not mounted. */
+dev_t GetPathDevice(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_dev : 0;
+}
+
+/** Watch the synced directory and 'extra_dirs' until SIGTERM or SIGINT is
+ * received on 'signal_fd'.  'complete' is the result of the first scan of
+ * the synced directory and is updated as file systems are mounted on it and
+ * removed, see main(). */
+void WatchLoop(int signal_fd, const std::vector<std::string> &extra_dirs, bool &complete)
+{
+    // The kernel flags /proc/self/mountinfo when the mount table changes.
+    int mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    dev_t source_dev = GetPathDevice(g_SourceDir);
+    // A scan which failed leaves the files it did not reach unmarked in the
+    // manifest, whichever device is mounted later, so it stops pruning for
+    // the rest of the run.
+    bool scans_ok = complete;
+
+    for (const auto &d : extra_dirs)
+        ScanPath(d);
+
+    std::vector<std::string> roots = extra_dirs;
+    roots.push_back(g_SourceDir);
+
+    std::set<std::string> files, dirs;
+    auto first_event = std::chrono::steady_clock::now();
+    auto last_event = first_event;
+
+    for (;;) {
+        int timeout = 1000;
+        auto now = std::chrono::steady_clock::now();
+        if (! files.empty() || ! dirs.empty()) {
+            auto due = std::min(last_event + watch_quiet_time, first_event + watch_max_delay);
+            timeout = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count());
         }
-        if (S_ISDIR(buf.st_mode)) {
-            // WARNING: funny, but correct test below
-            if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
-                g_DelayedDirs.push(path.str());
+
+        struct pollfd fds[3] = {
+            { g_Inotify, POLLIN, 0 },
+            { signal_fd, POLLIN, 0 },
+            { mounts_fd, POLLPRI, 0 }
+        };
+        int r = poll(fds, mounts_fd == -1 ? 2 : 3, timeout);
+        if (r == -1 && errno != EINTR) {
+            auto ex = UnixException("poll", errno);
+            LogMessage(LOG_ERR, ex.what());
+            break;
+        }
+        if (r > 0 && (fds[1].revents & POLLIN))
+            break;
+
+        now = std::chrono::steady_clock::now();
+        if (r > 0 && (fds[0].revents & POLLIN)) {
+            if (files.empty() && dirs.empty())
+                first_event = now;
+            last_event = now;
+            ReadWatchEvents(files, dirs, roots);
+        }
+
+        if (r > 0 && (fds[2].revents & (POLLPRI | POLLERR))) {
+            // Re-read the file to clear the change flag
+            char buf[4096];
+            lseek(mounts_fd, 0, SEEK_SET);
+            while (read(mounts_fd, buf, sizeof(buf)) > 0)
+                ;
+            dev_t dev = GetPathDevice(g_SourceDir);
+            if (dev != source_dev) {
+                // Only a complete scan of what is mounted now allows the
+                // manifest to be pruned.
+                complete = false;
+                if (dev != 0) {
+                    LogMessage(LOG_NOTICE, "mounts changed, scanning " + g_SourceDir);
+                    scans_ok = ScanPath(g_SourceDir) && scans_ok;
+                    complete = scans_ok;
+                }
+            }
+            source_dev = dev;
+        }
+
+        if ((! files.empty() || ! dirs.empty())
+            && (now >= last_event + watch_quiet_time || now >= first_event + watch_max_delay)) {
+            ProcessWatchEvents(files, dirs);
         }
-        else if (S_ISREG(buf.st_mode)) {
-            char *p = strrchr(e->d_name, '.');
-            if (p && strcasecmp(p, ".fit") == 0)
-                ProcessFitFile(path.str());
+        else if (r == 0) {
+            // Idle, save the files recorded so far
+            std::lock_guard<std::mutex> lock(g_ManifestMutex);
+            if (g_Manifest && g_Manifest->Pending() > 0)
+                g_Manifest->Save(false);
         }
     }
-    closedir(d);
+
+    if (mounts_fd != -1)
+        close(mounts_fd);
 }
 
 
+// options which only have a long form
+enum { opt_sync_batch = 256, opt_sync_delay, opt_watch };
+
 int main(int argc, char **argv)
 {
+    static const struct option long_options[] = {
+        { "rescan", no_argument, nullptr, 'r' },
+        { "jobs", required_argument, nullptr, 'j' },
+        { "timing", no_argument, nullptr, 't' },
+        { "sync-batch", required_argument, nullptr, opt_sync_batch },
+        { "sync-delay", required_argument, nullptr, opt_sync_delay },
+        { "watch", no_argument, nullptr, opt_watch },
+        { nullptr, 0, nullptr, 0 }
+    };
+
+    bool sync_delay_set = false;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "p:dah")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:dacirhj:t", long_options, nullptr)) != -1) {
         switch (opt) {
         case 'd':
             g_DaemonMode = ! g_DaemonMode;
@@ -165,11 +792,49 @@ int main(int argc, char **argv)
         case 'a':
             g_AllFiles = true;
             break;
+        case 'c':
+            g_VerifyCrc = true;
+            break;
+        case 'i':
+            g_WriteIndex = true;
+            break;
+        case 'r':
+            g_Rescan = true;
+            break;
         case 'p':
             g_PidFile = optarg;
             break;
+        case 'j':
+            if (! ParseJobs(optarg)) {
+                std::cerr << "Bad --jobs value: " << optarg << "\n";
+                return 1;
+            }
+            break;
+        case 't':
+            g_Timing = true;
+            break;
+        case opt_sync_batch:
+            g_SyncBatch = atoi(optarg);
+            if (g_SyncBatch < 1) {
+                std::cerr << "Bad --sync-batch value: " << optarg << "\n";
+                return 1;
+            }
+            break;
+        case opt_sync_delay:
+            g_SyncDelay = atoi(optarg);
+            if (g_SyncDelay < 0) {
+                std::cerr << "Bad --sync-delay value: " << optarg << "\n";
+                return 1;
+            }
+            sync_delay_set = true;
+            break;
+        case opt_watch:
+            g_WatchMode = true;
+            break;
         case 'h':
-            std::cerr << "Usage: " << argv[0] << " [-p PID_FILE] [-a] [-d] DIR\n";
+            std::cerr << "Usage: " << argv[0] << " [-p PID_FILE] [-a] [-c] [-i] [-r|--rescan]\n"
+                      << "    [-j|--jobs N|PROBE,READ,WRITE] [-t|--timing]\n"
+                      << "    [--sync-batch FILES] [--sync-delay MS] [--watch] [-d] DIR\n";
             return 1;
             break;
         default:
@@ -184,16 +849,34 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    char *dir = argv[optind];
+    // The directory is used by its absolute path, a relative one would not
+    // be found after the daemon changes directory.
+    std::string dir;
+    {
+        char *real_dir = realpath(argv[optind], nullptr);
+        if (! real_dir) {
+            auto ex = UnixException(std::string("realpath ") + argv[optind], errno);
+            std::cerr << ex.what() << std::endl;
+            return 1;
+        }
+        dir = real_dir;
+        free(real_dir);
+    }
+
+    if (g_WatchMode && ! sync_delay_set)
+        g_SyncDelay = watch_sync_delay;
 
     if (g_DaemonMode)
     {
         try {
-            // switch to the work dir, so it is not unmounted from beneath us.
-            int r = chdir(dir);
+            // switch to the work dir, so it is not unmounted from beneath
+            // us.  A resident watcher must not keep the device busy, it
+            // goes to the root directory instead.
+            std::string work_dir = g_WatchMode ? "/" : dir;
+            int r = chdir(work_dir.c_str());
             if (r != 0) {
                 std::ostringstream msg;
-                msg << "chdir( " << dir << ")";
+                msg << "chdir( " << work_dir << ")";
                 throw UnixException(msg.str(), errno);
             }
             r = daemon(1, 0);
@@ -201,7 +884,7 @@ int main(int argc, char **argv)
                 throw UnixException("daemon", errno);
             }
             openlog("fit-sync", 0, LOG_USER);
-            syslog(LOG_NOTICE, "started up, will process %s", dir);
+            syslog(LOG_NOTICE, "started up, will process %s", dir.c_str());
         }
         catch (const std::exception &e) {
             std::cerr << e.what() << std::endl;
@@ -211,19 +894,95 @@ int main(int argc, char **argv)
 
     if (! AquirePidLock(g_PidFile)) return 1;
 
+    // Entries for files no longer on the device are only dropped from the
+    // manifest after a complete scan.  In watch mode, this is the latest
+    // scan of the file system mounted on the directory, and there is none
+    // while the directory is gone.
+    bool complete = false;
     try {
-        g_DelayedDirs.push(dir);
-        while(! g_DelayedDirs.empty()) {
-            auto path = g_DelayedDirs.front();
-            g_DelayedDirs.pop();
-            ScanDir(path);
+        g_SourceDir = dir;
+        SyncManifest manifest(GetSyncManifestPath(dir));
+        if (! g_Rescan)
+            manifest.Load();
+        g_Manifest = &manifest;
+
+        // In watch mode, SIGTERM and SIGINT are received through a signalfd,
+        // so the watcher can finish the files in progress before it exits.
+        // They are blocked before the workers start, so the workers inherit
+        // the signal mask.
+        int signal_fd = -1;
+        if (g_WatchMode) {
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGTERM);
+            sigaddset(&signals, SIGINT);
+            pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+            signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+            g_Inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (signal_fd == -1 || g_Inotify == -1) {
+                throw UnixException("watch set up", errno);
+            }
+        }
+
+        std::vector<std::thread> probe_workers, read_workers, write_workers;
+        for (int i = 0; i < g_ProbeJobs; i++)
+            probe_workers.emplace_back(ProbeStage);
+        for (int i = 0; i < g_ReadJobs; i++)
+            read_workers.emplace_back(ReadStage);
+        for (int i = 0; i < g_WriteJobs; i++)
+            write_workers.emplace_back(WriteStage);
+
+        complete = ScanPath(g_SourceDir);
+
+        if (g_WatchMode) {
+            // The Dropbox share is watched too, files copied onto it are
+            // synced like the ones from a device.
+            std::vector<std::string> extra_dirs;
+            std::string dropbox = GetUserDataDir() + "/Dropbox";
+            struct stat st;
+            if (stat(dropbox.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                extra_dirs.push_back(dropbox);
+            LogMessage(LOG_NOTICE, "watching " + g_SourceDir
+                       + (extra_dirs.empty() ? "" : " and " + dropbox));
+            WatchLoop(signal_fd, extra_dirs, complete);
+            close(g_Inotify);
+            g_Inotify = -1;
+            close(signal_fd);
         }
+
+        // Each stage finishes the files already queued before the next
+        // stage is told there is no more work.
+        g_ProbeQueue.Close();
+        for (auto &t : probe_workers)
+            t.join();
+        g_ReadQueue.Close();
+        for (auto &t : read_workers)
+            t.join();
+        g_WriteQueue.Close();
+        for (auto &t : write_workers)
+            t.join();
+
+        g_Manifest = nullptr;
+        manifest.Save(complete);
     }
     catch (std::exception &e) {
         std::cout << e.what() << "\n";
         syslog(LOG_ERR, "%s", e.what());
     }
 
+    if (g_UnchangedFiles > 0) {
+        std::ostringstream msg;
+        msg << g_UnchangedFiles << " unchanged files skipped";
+        LogMessage(LOG_INFO, msg.str());
+    }
+
+    if (g_Timing) {
+        g_ScanTiming.Report(1);
+        g_ProbeTiming.Report(g_ProbeJobs);
+        g_ReadTiming.Report(g_ReadJobs);
+        g_WriteTiming.Report(g_WriteJobs);
+    }
+
     ReleasePidLock(g_PidFile);
 
     if (g_DaemonMode)